@@ -25,12 +25,18 @@ extern "C" {
 
 #include "apaz-libc/threadpool.h"
 
+#include "apaz-libc/taskgraph.h"
+
 #include "apaz-libc/list.h"
 
 #include "apaz-libc/string.h"
 
 #include "apaz-libc/arena.h"
 
+#include "apaz-libc/sharedarena.h"
+
+#include "apaz-libc/pool.h"
+
 #include "apaz-libc/profile.h"
 
 #include "apaz-libc/utf8.h"
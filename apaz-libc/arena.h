@@ -6,6 +6,8 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #ifndef __cplusplus
@@ -23,23 +25,86 @@ static inline size_t _roundToAlignment(size_t n, size_t alignment) {
   return (n + alignment - 1) / alignment * alignment;
 }
 
+// The size of the buffer Arena_new() starts with, and of the first chunk
+// allocated once it's full. Each chunk after that is twice as big as the last,
+// up to ARENA_MAX_CHUNK_SIZE.
+#ifndef ARENA_SIZE
 #define ARENA_SIZE (4096 * 128)
+#endif
+
+#ifndef ARENA_MAX_CHUNK_SIZE
+#define ARENA_MAX_CHUNK_SIZE (ARENA_SIZE * 128)
+#endif
 
+// Virtual arenas commit at least this much of their reservation at a time, or
+// ARENA_HUGE_PAGE_SIZE with huge pages.
+#ifndef ARENA_COMMIT_SIZE
+#define ARENA_COMMIT_SIZE (4096 * 16)
+#endif
+
+#ifndef ARENA_HUGE_PAGE_SIZE
+#define ARENA_HUGE_PAGE_SIZE (4096 * 512)
+#endif
 
 #if MEMDEBUG
 LIST_DEFINE(MemAlloc);
 #endif
 
+struct ArenaChunk;
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk {
+  ArenaChunk *next;
+  size_t cap;
+};
+
+// Counters every arena keeps, to tune ARENA_SIZE and friends by. Read them
+// with Arena_stats().
+struct ArenaStats;
+typedef struct ArenaStats ArenaStats;
+struct ArenaStats {
+  size_t requested; // Bytes asked for over the arena's life.
+  size_t padding;   // Bytes spent rounding up and aligning those.
+  size_t in_use;    // Bytes allocated now, padding included.
+  size_t peak;      // The most bytes that have been in use at once.
+  size_t capacity;  // Bytes the arena holds, used or not.
+  size_t chunks;    // Chunks allocated, not counting oversize ones.
+  size_t oversize;  // Allocations that got a chunk of their own.
+  size_t resets;
+};
+
 struct Arena;
 typedef struct Arena Arena;
 struct Arena {
   char *name;
-  Arena *next;
 
+  // Where allocations are bumped from. That's the buffer the arena was made
+  // with until it fills up, then the chunk it's on.
   void *buffer;
   size_t buf_size;
   size_t buf_cap;
 
+  // The buffer the arena was made with. For virtual arenas, that's the
+  // reserved address range, and first_cap is how much of it is committed.
+  void *first;
+  size_t first_cap;
+  size_t reserved;
+  size_t commit_size;
+
+  // Chunks allocated once the first buffer filled up, in the order they're
+  // used. Allocations come from current, or from the first buffer when it's
+  // NULL. The chunks after current are empty, kept from before a reset.
+  ArenaChunk *chunks;
+  ArenaChunk *current;
+  size_t next_cap;
+
+  // Allocations too big for a chunk. Each gets its own malloc().
+  ArenaChunk *oversize;
+
+  // Bytes in use outside the current buffer, in chunks before it and oversize
+  // allocations. Peak is only brought up to date before usage goes down.
+  size_t used_before;
+  ArenaStats stats;
+
 #if MEMDEBUG
   List_MemAlloc given;
 #endif
@@ -48,12 +113,24 @@ struct Arena {
 static inline Arena *Arena_init(Arena *arena, char *name, void *buffer,
                                 size_t buf_cap) {
   arena->name = name;
-  arena->next = NULL;
 
   arena->buffer = buffer;
   arena->buf_size = 0;
   arena->buf_cap = buf_cap; // yes
 
+  arena->first = buffer;
+  arena->first_cap = buf_cap;
+  arena->reserved = 0;
+  arena->commit_size = 0;
+
+  arena->chunks = NULL;
+  arena->current = NULL;
+  arena->next_cap = ARENA_SIZE;
+  arena->oversize = NULL;
+
+  arena->used_before = 0;
+  memset(&(arena->stats), 0, sizeof(ArenaStats));
+
 #if MEMDEBUG
   arena->given = List_MemAlloc_new_cap(50);
 #endif
@@ -64,12 +141,13 @@ static inline Arena *Arena_init(Arena *arena, char *name, void *buffer,
 #define Arena_new(name) _Arena_new(name, __LINE__, __func__, __FILE__)
 static inline Arena _Arena_new(char *name, size_t line, const char *func,
                                const char *file) {
+  (void)line, (void)func, (void)file;
   Arena arena;
   void *buffer = memdebug_malloc(ARENA_SIZE, line, func, file);
 
 #if APAZ_HANDLE_UNLIKELY_ERRORS && !MEMDEBUG
   if (!buffer) {
-    printf("Could not initialize arena %s. Passed a null buffer.\n");
+    printf("Could not initialize arena %s. Passed a null buffer.\n", name);
     exit(1);
   }
 #endif
@@ -79,41 +157,172 @@ static inline Arena _Arena_new(char *name, size_t line, const char *func,
   return arena;
 }
 
-static inline Arena *_Arena_new_on(Arena *current) {
+// Makes an arena that reserves reserve bytes of address space up front, and
+// commits pages as allocations reach them. Allocations stay contiguous, with
+// no chunks until the reservation runs out. Reserving costs no memory, so
+// reserve generously. With huge_pages, asks for transparent huge pages, which
+// take fewer TLB entries for big arenas. If the address space can't be
+// reserved, it's an ordinary arena that starts out empty.
+static inline Arena *Arena_init_virtual(Arena *arena, char *name,
+                                        size_t reserve, bool huge_pages) {
+  Arena_init(arena, name, NULL, 0);
+  size_t page =
+      huge_pages ? ARENA_HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+  reserve = _roundToAlignment(reserve, page);
+
+  // Huge pages have to be aligned to their size, so reserve extra and trim
+  // the ends off.
+  size_t slack = huge_pages ? page : 0;
+  char *range =
+      (char *)mmap(NULL, reserve + slack, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (range == (char *)MAP_FAILED)
+    return arena;
+  if (slack) {
+    char *aligned = (char *)_roundToAlignment((size_t)range, page);
+    if (aligned != range)
+      munmap(range, (size_t)(aligned - range));
+    if (aligned + reserve != range + reserve + slack)
+      munmap(aligned + reserve, (size_t)(range + slack - aligned));
+    range = aligned;
+#ifdef MADV_HUGEPAGE
+    madvise(range, reserve, MADV_HUGEPAGE);
+#endif
+  }
 
-  // Allocate a new Arena.
-  Arena *new_arena = (Arena *)malloc(sizeof(Arena));
-  size_t reserved = _roundToAlignment(sizeof(Arena), ALIGNOF(Arena));
-  void *buffer = ((char *)new_arena) + reserved;
+  arena->buffer = range;
+  arena->first = range;
+  arena->reserved = reserve;
+  arena->commit_size = huge_pages ? page : ARENA_COMMIT_SIZE;
+  return arena;
+}
+
+// Commits enough of a virtual arena's reservation to hold upto bytes, at least
+// doubling what's committed. Returns false if it doesn't fit.
+static inline bool _Arena_commit(Arena *arena, size_t upto) {
+  if (upto > arena->reserved)
+    return false;
+  size_t target = arena->first_cap * 2 > upto ? arena->first_cap * 2 : upto;
+  target = _roundToAlignment(target, arena->commit_size);
+  if (target > arena->reserved)
+    target = arena->reserved;
+  if (mprotect(((char *)arena->first) + arena->first_cap,
+               target - arena->first_cap, PROT_READ | PROT_WRITE))
+    return false;
+  arena->first_cap = target;
+  arena->buf_cap = target;
+  return true;
+}
+
+// Chunk buffers start after the header, aligned like malloc().
+#define _ARENA_CHUNK_HEADER                                                    \
+  _roundToAlignment(sizeof(ArenaChunk), ALIGNOF(max_align_t))
+
+static inline void *_ArenaChunk_buffer(ArenaChunk *chunk) {
+  return ((char *)chunk) + _ARENA_CHUNK_HEADER;
+}
+
+static inline ArenaChunk *_ArenaChunk_new(Arena *arena, size_t cap) {
+  (void)arena;
+  ArenaChunk *chunk = (ArenaChunk *)malloc(_ARENA_CHUNK_HEADER + cap);
 #if APAZ_HANDLE_UNLIKELY_ERRORS && !MEMDEBUG
-  if (!buffer | !new_arena) {
-    printf("Out of memory allocating arena %s.\n");
+  if (!chunk) {
+    printf("Out of memory allocating arena %s.\n", arena->name);
     exit(1);
   }
 #endif
-  Arena_init(new_arena, current->name, buffer, ARENA_SIZE - reserved);
+  chunk->next = NULL;
+  chunk->cap = cap;
+  return chunk;
+}
 
-  // Throw it into the LL.
-  while (current->next)
-    current = current->next;
-  current->next = new_arena;
+// Rounds ptr up to a multiple of align, which is a power of two.
+static inline uintptr_t _Arena_align_up(uintptr_t ptr, size_t align) {
+  return (ptr + align - 1) & ~(uintptr_t)(align - 1);
+}
 
-  return new_arena;
+// Called by Arena_malloc() when the current buffer is full.
+static inline void *_Arena_grow(Arena *arena, size_t num_bytes,
+                                size_t align) {
+  // Virtual arenas commit more of their reservation, while it lasts.
+  if (arena->reserved && !arena->current) {
+    uintptr_t base = (uintptr_t)arena->first;
+    size_t start = _Arena_align_up(base + arena->buf_size, align) - base;
+    if (_Arena_commit(arena, start + num_bytes)) {
+      arena->buf_size = start + num_bytes;
+      return ((char *)arena->first) + start;
+    }
+  }
+
+  // Chunk buffers are only aligned like malloc(), so leave room to align
+  // further.
+  size_t need = num_bytes;
+  if (align > ALIGNOF(max_align_t))
+    need += align - ALIGNOF(max_align_t);
+
+  // Big allocations get a chunk of their own, so that they don't waste the
+  // rest of the current one.
+  if (need > ARENA_MAX_CHUNK_SIZE / 4) {
+    ArenaChunk *big = _ArenaChunk_new(arena, need);
+    big->next = arena->oversize;
+    arena->oversize = big;
+    arena->used_before += need;
+    arena->stats.oversize++;
+    return (void *)_Arena_align_up((uintptr_t)_ArenaChunk_buffer(big), align);
+  }
+
+  // Move on to the next chunk if there's one left over from before a reset
+  // that fits. Otherwise make one, bigger than the last.
+  ArenaChunk **link =
+      arena->current ? &(arena->current->next) : &(arena->chunks);
+  ArenaChunk *chunk = *link;
+  if (!chunk || chunk->cap < need) {
+    while (arena->next_cap < need)
+      arena->next_cap *= 2;
+    chunk = _ArenaChunk_new(arena, arena->next_cap);
+    chunk->next = *link;
+    *link = chunk;
+    arena->stats.chunks++;
+    arena->next_cap = arena->next_cap * 2 < ARENA_MAX_CHUNK_SIZE
+                          ? arena->next_cap * 2
+                          : ARENA_MAX_CHUNK_SIZE;
+  }
+
+  arena->used_before += arena->buf_size;
+  arena->current = chunk;
+  arena->buffer = _ArenaChunk_buffer(chunk);
+  arena->buf_cap = chunk->cap;
+  uintptr_t base = (uintptr_t)arena->buffer;
+  arena->buf_size = _Arena_align_up(base, align) - base + num_bytes;
+  return ((char *)arena->buffer) + (arena->buf_size - num_bytes);
+}
+
+static inline void _ArenaChunk_free_all(ArenaChunk *chunk) {
+  while (chunk) {
+    ArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
 }
 
 static inline void Arena_destroy(Arena *arena, bool free_arena_ptr,
                                  bool free_buffer_ptr) {
 
-  // The first arena could be allocated in any way, hence the args. The
-  // remaining ones are always allocated by Arena_new_on().
-
-  // Destroy the first one.
-  Arena *next = arena->next;
-  if (free_buffer_ptr)
-    free(arena->buffer);
+  // The first buffer could be allocated in any way, hence the args. The
+  // chunks are always allocated by the arena, and so is a virtual arena's
+  // reservation.
+  if (arena->reserved)
+    munmap(arena->first, arena->reserved);
+  else if (free_buffer_ptr)
+    free(arena->first);
+  _ArenaChunk_free_all(arena->chunks);
+  _ArenaChunk_free_all(arena->oversize);
   arena->name = NULL;
-  arena->next = NULL;
   arena->buffer = NULL;
+  arena->first = NULL;
+  arena->chunks = NULL;
+  arena->current = NULL;
+  arena->oversize = NULL;
   arena->buf_cap = 0;
   arena->buf_size = SIZE_MAX;
 #if MEMDEBUG
@@ -121,55 +330,68 @@ static inline void Arena_destroy(Arena *arena, bool free_arena_ptr,
 #endif
   if (free_arena_ptr)
     free(arena);
-
-  // Destroy the rest.
-  arena = next;
-  while (arena) {
-    Arena *next = arena->next;
-#if MEMDEBUG
-    List_MemAlloc_destroy(arena->given);
-#endif
-    free(arena);
-    arena = next;
-  }
 }
 
-#define Arena_malloc(arena, bytes)                                             \
-  _Arena_malloc(arena, bytes, __LINE__, __func__, __FILE__)
-#define Arena_malloc_of(arena, type)                                           \
-  _Arena_malloc(arena, sizeof(type), __LINE__, __func__, __FILE__)
-static inline void *_Arena_malloc(Arena *arena, size_t num_bytes, size_t line,
-                                  const char *func, const char *file) {
-  // Align
-  num_bytes = _roundToAlignment(num_bytes, ALIGNOF(max_align_t));
+static inline void _Arena_note_peak(Arena *arena) {
+  size_t in_use = arena->used_before + arena->buf_size;
+  if (in_use > arena->stats.peak)
+    arena->stats.peak = in_use;
+}
 
+// Frees everything allocated on the arena at once. The chunks are kept to be
+// used again, so an arena that's reset and refilled the same way stops
+// calling malloc() after the first time.
+static inline void Arena_reset(Arena *arena) {
+  _Arena_note_peak(arena);
+  arena->used_before = 0;
+  arena->stats.resets++;
+  _ArenaChunk_free_all(arena->oversize);
+  arena->oversize = NULL;
+  arena->current = NULL;
+  arena->buffer = arena->first;
+  arena->buf_cap = arena->first_cap;
+  arena->buf_size = 0;
 #if MEMDEBUG
-  if (num_bytes > arena->buf_cap) {
-    fprintf(stdout,
-            ANSI_COLOR_RESET
-            "Impossible to allocate " ANSI_COLOR_BYTE "%zu" ANSI_COLOR_RESET
-            " bytes on arena: %s. Error inside " ANSI_COLOR_FUNC
-            "%s()" ANSI_COLOR_RESET " on line " ANSI_COLOR_LINE
-            "%zu" ANSI_COLOR_RESET " in " ANSI_COLOR_FILE "%s" ANSI_COLOR_RESET
-            ".\n",
-            num_bytes, arena->name, func, line, file);
-    exit(1);
-  }
+  __List_MemAlloc_setlen(arena->given, 0);
 #endif
+}
+
+// Allocates num_bytes aligned to align, which must be a power of two. Unlike
+// Arena_malloc(), the size isn't rounded up, so small objects pack tightly.
+#define Arena_malloc_aligned(arena, bytes, align)                              \
+  _Arena_malloc_aligned(arena, bytes, align, __LINE__, __func__, __FILE__)
+// Allocates an array of n of type, aligned for type.
+#define Arena_malloc_array_of(arena, type, n)                                  \
+  ((type *)_Arena_malloc_aligned(arena, sizeof(type) * (n), ALIGNOF(type),     \
+                                 __LINE__, __func__, __FILE__))
+
+// Allocates num_bytes, of which the caller asked for requested.
+static inline void *_Arena_alloc(Arena *arena, size_t num_bytes, size_t align,
+                                 size_t requested, size_t line,
+                                 const char *func, const char *file) {
+  (void)line, (void)func, (void)file;
+  size_t in_use = arena->used_before + arena->buf_size;
 
 #if MEMDEBUG && PRINT_MEMALLOCS
-  Arena *original = arena;
-  size_t prev_size = original->buf_size;
-  char *name = original->name;
+  size_t prev_size = arena->buf_size;
+  char *name = arena->name;
 #endif
 
-  // Build another arena on this one if it's full, and use it instead.
-  if (arena->buf_size + num_bytes >= arena->buf_cap)
-    arena = _Arena_new_on(arena);
+  // Claim some memory, moving on to another chunk if this one's full.
+  void *ptr;
+  uintptr_t base = (uintptr_t)arena->buffer;
+  size_t start = _Arena_align_up(base + arena->buf_size, align) - base;
+  if (start + num_bytes <= arena->buf_cap) {
+    ptr = ((char *)arena->buffer) + start;
+    arena->buf_size = start + num_bytes;
+  } else {
+    ptr = _Arena_grow(arena, num_bytes, align);
+  }
 
-  // Claim some memory.
-  void *ptr = ((char *)arena->buffer) + arena->buf_size;
-  arena->buf_size = arena->buf_size + num_bytes;
+  // Whatever it took beyond what was asked for is padding.
+  arena->stats.requested += requested;
+  arena->stats.padding +=
+      arena->used_before + arena->buf_size - in_use - requested;
 
 #if MEMDEBUG
   // Keep a record of it
@@ -200,6 +422,125 @@ static inline void *_Arena_malloc(Arena *arena, size_t num_bytes, size_t line,
   return ptr;
 }
 
+static inline void *_Arena_malloc_aligned(Arena *arena, size_t num_bytes,
+                                          size_t align, size_t line,
+                                          const char *func, const char *file) {
+  return _Arena_alloc(arena, num_bytes, align, num_bytes, line, func, file);
+}
+
+// Allocates like malloc(), aligned for any type. Sizes are rounded up to that
+// alignment, so that Arena_pop() can take them back off.
+#define Arena_malloc(arena, bytes)                                             \
+  _Arena_malloc(arena, bytes, __LINE__, __func__, __FILE__)
+#define Arena_malloc_of(arena, type)                                           \
+  _Arena_malloc(arena, sizeof(type), __LINE__, __func__, __FILE__)
+static inline void *_Arena_malloc(Arena *arena, size_t num_bytes, size_t line,
+                                  const char *func, const char *file) {
+  return _Arena_alloc(arena, _roundToAlignment(num_bytes, ALIGNOF(max_align_t)),
+                      ALIGNOF(max_align_t), num_bytes, line, func, file);
+}
+
+// Resizes an allocation made with Arena_malloc() from old_size to new_size
+// bytes. If it's the last thing allocated and there's room, it's resized
+// where it is. Otherwise it's copied to a new allocation, and the old one is
+// left where it is until the arena is reset.
+#define Arena_realloc(arena, ptr, old_size, new_size)                          \
+  _Arena_realloc(arena, ptr, old_size, new_size, __LINE__, __func__, __FILE__)
+static inline void *_Arena_realloc(Arena *arena, void *ptr, size_t old_size,
+                                   size_t new_size, size_t line,
+                                   const char *func, const char *file) {
+  if (!ptr)
+    return _Arena_malloc(arena, new_size, line, func, file);
+
+  size_t old_rounded = _roundToAlignment(old_size, ALIGNOF(max_align_t));
+  size_t new_rounded = _roundToAlignment(new_size, ALIGNOF(max_align_t));
+  char *end = ((char *)arena->buffer) + arena->buf_size;
+  if ((char *)ptr + old_rounded == end &&
+      arena->buf_size - old_rounded + new_rounded <= arena->buf_cap) {
+    _Arena_note_peak(arena);
+    arena->buf_size = arena->buf_size - old_rounded + new_rounded;
+    if (new_size > old_size) {
+      arena->stats.requested += new_size - old_size;
+      arena->stats.padding +=
+          (new_rounded - old_rounded) - (new_size - old_size);
+    }
+#if MEMDEBUG
+    size_t num_given = List_MemAlloc_len(arena->given);
+    if (num_given && arena->given[num_given - 1].ptr == ptr)
+      arena->given[num_given - 1].size = new_rounded;
+#endif
+    return ptr;
+  }
+
+  void *moved = _Arena_malloc(arena, new_size, line, func, file);
+  memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+  return moved;
+}
+
+// A point in an arena's allocations to go back to with Arena_rewind().
+struct ArenaMark;
+typedef struct ArenaMark ArenaMark;
+struct ArenaMark {
+  ArenaChunk *current;
+  size_t buf_size;
+  ArenaChunk *oversize;
+  size_t used_before;
+#if MEMDEBUG
+  size_t num_given;
+#endif
+};
+
+static inline ArenaMark Arena_mark(Arena *arena) {
+  ArenaMark mark;
+  mark.current = arena->current;
+  mark.buf_size = arena->buf_size;
+  mark.oversize = arena->oversize;
+  mark.used_before = arena->used_before;
+#if MEMDEBUG
+  mark.num_given = List_MemAlloc_len(arena->given);
+#endif
+  return mark;
+}
+
+// Frees everything allocated since the mark was taken, in every chunk. The
+// chunks are kept to be used again, like Arena_reset(). A mark is no good
+// once the arena is reset or rewound to before it.
+static inline void Arena_rewind(Arena *arena, ArenaMark mark) {
+  _Arena_note_peak(arena);
+  arena->used_before = mark.used_before;
+  while (arena->oversize != mark.oversize) {
+    ArenaChunk *next = arena->oversize->next;
+    free(arena->oversize);
+    arena->oversize = next;
+  }
+  arena->current = mark.current;
+  arena->buffer =
+      mark.current ? _ArenaChunk_buffer(mark.current) : arena->first;
+  arena->buf_cap = mark.current ? mark.current->cap : arena->first_cap;
+  arena->buf_size = mark.buf_size;
+#if MEMDEBUG
+  __List_MemAlloc_setlen(arena->given, mark.num_given);
+#endif
+}
+
+// Frees the chunks that aren't in use, the ones kept by a reset or rewind.
+// Virtual arenas also give back the pages past what's in use, which stay
+// committed and come back zeroed when they're next touched.
+static inline void Arena_trim(Arena *arena) {
+  ArenaChunk **link =
+      arena->current ? &(arena->current->next) : &(arena->chunks);
+  _ArenaChunk_free_all(*link);
+  *link = NULL;
+
+  if (arena->reserved) {
+    size_t in_use = arena->current ? arena->first_cap : arena->buf_size;
+    in_use = _roundToAlignment(in_use, (size_t)sysconf(_SC_PAGESIZE));
+    if (in_use < arena->first_cap)
+      madvise(((char *)arena->first) + in_use, arena->first_cap - in_use,
+              MADV_DONTNEED);
+  }
+}
+
 #define Arena_pop(arena, bytes)                                                \
   _Arena_pop(arena, _roundToAlignment(bytes, ALIGNOF(max_align_t)), __LINE__,  \
              __func__, __FILE__)
@@ -208,11 +549,13 @@ static inline void *_Arena_malloc(Arena *arena, size_t num_bytes, size_t line,
              __LINE__, __func__, __FILE__)
 static inline void _Arena_pop(Arena *arena, size_t n, size_t line,
                               const char *func, const char *file) {
+  (void)line, (void)func, (void)file;
 #if MEMDEBUG && PRINT_MEMALLOCS
   size_t prev_size = arena->buf_size;
 #endif
 
   // Handle underflow
+  _Arena_note_peak(arena);
   arena->buf_size = arena->buf_size > n ? arena->buf_size - n : 0;
 
 #if MEMDEBUG
@@ -233,21 +576,41 @@ static inline void _Arena_pop(Arena *arena, size_t n, size_t line,
 #endif
 }
 
+static inline ArenaStats Arena_stats(Arena *arena) {
+  _Arena_note_peak(arena);
+  ArenaStats stats = arena->stats;
+  stats.in_use = arena->used_before + arena->buf_size;
+  stats.capacity = arena->first_cap;
+  for (ArenaChunk *chunk = arena->chunks; chunk; chunk = chunk->next)
+    stats.capacity += chunk->cap;
+  for (ArenaChunk *chunk = arena->oversize; chunk; chunk = chunk->next)
+    stats.capacity += chunk->cap;
+  return stats;
+}
+
+static inline void Arena_print_stats(Arena *arena) {
+  ArenaStats stats = Arena_stats(arena);
+  printf("Arena %s: %zu bytes in use, %zu at peak, %zu held. Over its life, "
+         "%zu chunks and %zu oversize allocated, %zu bytes requested, %zu "
+         "padding, %zu resets.\n",
+         arena->name ? arena->name : "", stats.in_use, stats.peak,
+         stats.capacity, stats.chunks, stats.oversize, stats.requested,
+         stats.padding, stats.resets);
+}
+
 static inline void Arena_print_memallocs(Arena *arena) {
+  (void)arena;
 #if MEMDEBUG
 
-  // Create one big list that's a copy of all the allocations stored.
-  // At the same time, get the total number of bytes allocated.
+  // Copy the allocations stored, and get the total number of bytes allocated.
   List_MemAlloc all_arena_allocs = List_MemAlloc_new_cap(1000);
+  all_arena_allocs = List_MemAlloc_addAlleq(all_arena_allocs, arena->given);
+  size_t num_arena_allocs = List_MemAlloc_len(all_arena_allocs);
   size_t total_bytes = 0;
-  do {
-    all_arena_allocs = List_MemAlloc_addAlleq(all_arena_allocs, arena->given);
-    total_bytes += arena->buf_size;
-  } while ((arena = arena->next));
+  for (size_t i = 0; i < num_arena_allocs; i++)
+    total_bytes += all_arena_allocs[i].size;
 
-  // Sort the list of all allocations. This does not modify the order of the
-  // original lists.
-  size_t num_arena_allocs = List_MemAlloc_len(all_arena_allocs);
+  // Sort the copy. This does not modify the order of the original list.
   sort_memallocs(all_arena_allocs, num_arena_allocs);
 
   // Print the results.
@@ -292,4 +655,91 @@ static inline void Arena_print_memallocs(Arena *arena) {
 #endif
 }
 
+/******************************************************************************/
+#define LIST_DEFINE_ARENA(type)                                                \
+  /**                                                                          \
+   * Like List_##type##_new_cap(), but allocates the list on the arena. Lists  \
+   * made on an arena are freed with it. Don't List_##type##_destroy() them,   \
+   * and only grow them with the _on() functions, on the same arena.           \
+   */                                                                          \
+  static inline List_##type List_##type##_new_cap_on(Arena *arena,             \
+                                                     size_t capacity) {        \
+    size_t *stptr = (size_t *)Arena_malloc(                                    \
+        arena, sizeof(size_t) * 2 + sizeof(type) * capacity);                  \
+    stptr[0] = 0;                                                              \
+    stptr[1] = capacity;                                                       \
+    return (List_##type)(stptr + 2);                                           \
+  }                                                                            \
+                                                                               \
+  static inline List_##type List_##type##_new_len_on(Arena *arena,             \
+                                                     size_t len) {             \
+    List_##type list = List_##type##_new_cap_on(arena, len);                   \
+    __List_##type##_setlen(list, len);                                         \
+    return list;                                                               \
+  }                                                                            \
+                                                                               \
+  /**                                                                          \
+   * Like List_##type##_resize(). When the list is the last thing allocated    \
+   * on the arena, it grows or shrinks in place.                               \
+   */                                                                          \
+  static inline List_##type List_##type##_resize_on(                           \
+      Arena *arena, List_##type to_resize, size_t new_capacity) {              \
+    size_t *vptr = ((size_t *)to_resize) - 2;                                  \
+    size_t *stptr = (size_t *)Arena_realloc(                                   \
+        arena, vptr, sizeof(size_t) * 2 + sizeof(type) * vptr[1],              \
+        sizeof(size_t) * 2 + sizeof(type) * new_capacity);                     \
+    stptr[0] = MIN(new_capacity, stptr[0]);                                    \
+    stptr[1] = new_capacity;                                                   \
+    return (List_##type)(stptr + 2);                                           \
+  }                                                                            \
+                                                                               \
+  /* Like List_##type##_reserve(). */                                          \
+  static inline List_##type List_##type##_reserve_on(                          \
+      Arena *arena, List_##type list, size_t n) {                              \
+    if (n <= List_##type##_cap(list))                                          \
+      return list;                                                             \
+    return List_##type##_resize_on(arena, list, n);                            \
+  }                                                                            \
+                                                                               \
+  static inline List_##type List_##type##_addeq_on(                            \
+      Arena *arena, List_##type list, type to_append) {                        \
+    size_t current_len = List_##type##_len(list);                              \
+    size_t current_cap = List_##type##_cap(list);                              \
+    if (current_len == current_cap)                                            \
+      list = List_##type##_resize_on(                                          \
+          arena, list,                                                         \
+          __List_##type##_grow_cap(current_cap, current_len + 1));             \
+    __List_##type##_setlen(list, current_len + 1);                             \
+    list[current_len] = to_append;                                             \
+    return list;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline List_##type List_##type##_addAlleq_on(                         \
+      Arena *arena, List_##type list, List_##type to_append) {                 \
+    size_t lenl = List_##type##_len(list);                                     \
+    size_t lent = List_##type##_len(to_append);                                \
+    if (lenl + lent > List_##type##_cap(list))                                 \
+      list = List_##type##_resize_on(                                          \
+          arena, list,                                                         \
+          __List_##type##_grow_cap(List_##type##_cap(list), lenl + lent));     \
+    for (size_t i = 0; i < lent; i++)                                          \
+      list[i + lenl] = to_append[i];                                           \
+    __List_##type##_setlen(list, lenl + lent);                                 \
+    return list;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline List_##type List_##type##_clone_on(Arena *arena,               \
+                                                   List_##type to_clone) {     \
+    size_t len = List_##type##_len(to_clone);                                  \
+    List_##type nl = List_##type##_new_len_on(arena, len);                     \
+    for (size_t i = 0; i < len; i++)                                           \
+      nl[i] = to_clone[i];                                                     \
+    return nl;                                                                 \
+  }
+/****************************************************************************/
+
+// Lists defined from here on get the _on() functions.
+#undef LIST_ARENA_HOOK
+#define LIST_ARENA_HOOK(type) LIST_DEFINE_ARENA(type)
+
 #endif // ARENA_INCLUDE
\ No newline at end of file
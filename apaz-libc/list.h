@@ -1,17 +1,55 @@
 #ifndef INCLUDE_LISTUTIL
 #define INCLUDE_LISTUTIL
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#if defined(__GLIBC__) && !MEMDEBUG
+#include <malloc.h>
+#endif
 
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
 #define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
 
+// Expanded at the end of LIST_DEFINE(). arena.h redefines it to give lists
+// the _on() functions, which allocate on an Arena. Lists defined before
+// arena.h is included can get them with LIST_DEFINE_ARENA(type).
+#ifndef LIST_ARENA_HOOK
+#define LIST_ARENA_HOOK(type)
+#endif
+
+// The capacity a list grows to when it runs out of room, given the capacity it
+// had. Lists never grow to less than they need, whatever this says. Define it
+// before including list.h to change it for every list, or pick one for a
+// single type with LIST_DEFINE_GROWTH().
+#ifndef LIST_GROWTH
+#define LIST_GROWTH(cap) ((cap) + ((cap) >> 1) + 16)
+#endif
+
+// How many bytes of a block malloc() gave back for requested bytes are usable.
+// Allocators round requests up to a size class, and lists grow into the rest
+// instead of asking for it later. MEMDEBUG tracks the requested size, so
+// lists don't claim more than that while it's on.
+static inline size_t _List_usable_size(void *block, size_t requested) {
+#if defined(__GLIBC__) && !MEMDEBUG
+  (void)requested;
+  return malloc_usable_size(block);
+#else
+  (void)block;
+  return requested;
+#endif
+}
+
 #define LIST_DECLARE(type)                                                     \
   typedef type *List_##type;                                                   \
   _Static_assert(((2 * sizeof(size_t)) % _Alignof(type)) == 0,                 \
                  "Contents of " #type " list would be misalligned.");
 
+#define LIST_DEFINE(type) LIST_DEFINE_GROWTH(type, LIST_GROWTH)
+
 /******************************************************************************/
-#define LIST_DEFINE(type)                                                      \
+// Like LIST_DEFINE(type), but lists of this type grow to growth(cap) when they
+// run out of room, where growth is a function or macro like LIST_GROWTH.
+#define LIST_DEFINE_GROWTH(type, growth)                                       \
   LIST_DECLARE(type);                                                          \
                                                                                \
   /* Builtin Utility Functions */                                              \
@@ -25,6 +63,20 @@
     *(((size_t *)list) - 1) = new_cap;                                         \
   }                                                                            \
                                                                                \
+  /* The capacity to grow to, to make room for at least need items. */         \
+  static inline size_t __List_##type##_grow_cap(size_t cap, size_t need) {     \
+    size_t grown = growth(cap);                                                \
+    return grown > need ? grown : need;                                        \
+  }                                                                            \
+                                                                               \
+  /* Takes the slack malloc() left at the end of the list as capacity. */      \
+  static inline void __List_##type##_claim_slack(List_##type list) {           \
+    size_t *header = ((size_t *)list) - 2;                                     \
+    size_t asked = sizeof(size_t) * 2 + sizeof(type) * header[1];              \
+    size_t usable = _List_usable_size(header, asked);                          \
+    header[1] = (usable - sizeof(size_t) * 2) / sizeof(type);                  \
+  }                                                                            \
+                                                                               \
   /**                                                                          \
    * Constructs a new list of the specified capacity. The returned list must   \
    * be freed with List_##type##_destroy(), as it is allocated in a clever     \
@@ -94,6 +146,28 @@
     return (List_##type)stptr;                                                 \
   }                                                                            \
                                                                                \
+  /* Grows the list to make room for at least need items. */                   \
+  static inline List_##type __List_##type##_grow(List_##type list,             \
+                                                 size_t need) {                \
+    list = List_##type##_resize(                                               \
+        list, __List_##type##_grow_cap(*(((size_t *)list) - 1), need));        \
+    __List_##type##_claim_slack(list);                                         \
+    return list;                                                               \
+  }                                                                            \
+                                                                               \
+  /**                                                                          \
+   * Makes sure the list has room for at least n items, so that adding up to   \
+   * that many won't realloc(). Returns the list, which may have moved.        \
+   */                                                                          \
+  static inline List_##type List_##type##_reserve(List_##type list,            \
+                                                  size_t n) {                  \
+    if (n <= *(((size_t *)list) - 1))                                          \
+      return list;                                                             \
+    list = List_##type##_resize(list, n);                                      \
+    __List_##type##_claim_slack(list);                                         \
+    return list;                                                               \
+  }                                                                            \
+                                                                               \
   /**                                                                          \
    *  Frees the memory allocated to the list. The list becomes unusable        \
    *  after this point.                                                        \
@@ -151,8 +225,7 @@
     size_t current_cap = List_##type##_cap(list);                              \
     __List_##type##_setlen(list, current_len + 1);                             \
     if (current_len == current_cap)                                            \
-      *list_ref = list =                                                       \
-          List_##type##_resize(list, (size_t)(current_cap * 1.5) + 16);        \
+      *list_ref = list = __List_##type##_grow(list, current_len + 1);          \
     list[current_len] = to_append;                                             \
   }                                                                            \
                                                                                \
@@ -170,7 +243,7 @@
     size_t current_cap = List_##type##_cap(list);                              \
     __List_##type##_setlen(list, current_len + 1);                             \
     if (current_len == current_cap)                                            \
-      list = List_##type##_resize(list, (size_t)(current_cap * 1.5) + 16);     \
+      list = __List_##type##_grow(list, current_len + 1);                      \
     list[current_len] = to_append;                                             \
     return list;                                                               \
   }                                                                            \
@@ -184,7 +257,7 @@
     size_t lenl = List_##type##_len(list);                                     \
     size_t lent = List_##type##_len(to_append);                                \
     if (lenl + lent > List_##type##_cap(list))                                 \
-      list = List_##type##_resize(list, (lenl + lent) * 1.5 + 16);             \
+      list = __List_##type##_grow(list, lenl + lent);                          \
     for (size_t i = 0; i < lent; i++)                                          \
       list[i + lenl] = to_append[i];                                           \
     __List_##type##_setlen(list, lenl + lent);                                 \
@@ -293,6 +366,88 @@
     for (size_t i = 0; i < len; i++)                                           \
       action_fn(list[i], extra_data);                                          \
     List_##type##_destroy(list);                                               \
+  }                                                                            \
+                                                                               \
+  LIST_ARENA_HOOK(type)
+/****************************************************************************/
+
+/******************************************************************************/
+// A list that holds its first N items inline, in a struct that can live on the
+// stack or inside another struct, and only goes to the heap once it grows past
+// them. sl.list is an ordinary List_##type either way, so everything that reads
+// a List_##type works on it. While it's small it points into the struct, so
+// don't copy the struct. Needs LIST_DEFINE(type) first.
+#define LIST_DEFINE_SMALL(type, N)                                             \
+  struct SmallList_##type##_##N;                                               \
+  typedef struct SmallList_##type##_##N SmallList_##type##_##N;                \
+  struct SmallList_##type##_##N {                                              \
+    List_##type list;                                                          \
+    /* Laid out like the header and items of a list on the heap. */            \
+    size_t len;                                                                \
+    size_t cap;                                                                \
+    type items[N];                                                             \
+  };                                                                           \
+  _Static_assert(offsetof(SmallList_##type##_##N, items) -                     \
+                         offsetof(SmallList_##type##_##N, len) ==              \
+                     2 * sizeof(size_t),                                       \
+                 "Inline " #type " items would be misaligned.");               \
+                                                                               \
+  static inline List_##type SmallList_##type##_##N##_init(                     \
+      SmallList_##type##_##N *sl) {                                            \
+    sl->len = 0;                                                               \
+    sl->cap = N;                                                               \
+    return sl->list = sl->items;                                               \
+  }                                                                            \
+                                                                               \
+  static inline bool SmallList_##type##_##N##_is_inline(                       \
+      SmallList_##type##_##N *sl) {                                            \
+    return sl->list == sl->items;                                              \
+  }                                                                            \
+                                                                               \
+  /* Moves the items to the heap, with room for at least capacity of them. */  \
+  static inline void _SmallList_##type##_##N##_spill(                          \
+      SmallList_##type##_##N *sl, size_t capacity) {                           \
+    List_##type heap = List_##type##_new_cap(capacity);                        \
+    for (size_t i = 0; i < sl->len; i++)                                       \
+      heap[i] = sl->items[i];                                                  \
+    __List_##type##_setlen(heap, sl->len);                                     \
+    __List_##type##_claim_slack(heap);                                         \
+    sl->list = heap;                                                           \
+  }                                                                            \
+                                                                               \
+  static inline void SmallList_##type##_##N##_add(                             \
+      SmallList_##type##_##N *sl, type to_append) {                            \
+    if (SmallList_##type##_##N##_is_inline(sl)) {                              \
+      if (sl->len < N) {                                                       \
+        sl->items[sl->len++] = to_append;                                      \
+        return;                                                                \
+      }                                                                        \
+      _SmallList_##type##_##N##_spill(sl, __List_##type##_grow_cap(N, N + 1)); \
+    }                                                                          \
+    List_##type##_add(&(sl->list), to_append);                                 \
+  }                                                                            \
+                                                                               \
+  static inline void SmallList_##type##_##N##_addAll(                          \
+      SmallList_##type##_##N *sl, List_##type to_append) {                     \
+    size_t lent = List_##type##_len(to_append);                                \
+    if (SmallList_##type##_##N##_is_inline(sl)) {                              \
+      if (sl->len + lent <= N) {                                               \
+        for (size_t i = 0; i < lent; i++)                                      \
+          sl->items[sl->len++] = to_append[i];                                 \
+        return;                                                                \
+      }                                                                        \
+      _SmallList_##type##_##N##_spill(                                         \
+          sl, __List_##type##_grow_cap(N, sl->len + lent));                    \
+    }                                                                          \
+    sl->list = List_##type##_addAlleq(sl->list, to_append);                    \
+  }                                                                            \
+                                                                               \
+  /* Frees the heap copy if it got one. Ready to be used again after. */       \
+  static inline void SmallList_##type##_##N##_destroy(                         \
+      SmallList_##type##_##N *sl) {                                            \
+    if (!SmallList_##type##_##N##_is_inline(sl))                               \
+      List_##type##_destroy(sl->list);                                         \
+    SmallList_##type##_##N##_init(sl);                                         \
   }
 /****************************************************************************/
 
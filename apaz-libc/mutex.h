@@ -1,7 +1,8 @@
 #ifndef MUTEX_INCLUDE
 #define MUTEX_INCLUDE
 
-// All mutex functions return 0 on success
+// All mutex and condition variable functions return 0 on success. A timed
+// wait that times out returns nonzero.
 
 #ifdef _WIN32
 // Use windows.h if compiling for Windows
@@ -23,9 +24,33 @@ static inline int mutex_unlock(mutex_t *mutex) {
 }
 static inline int mutex_destroy(mutex_t *mutex) { return 0; }
 
+#define cond_t CONDITION_VARIABLE
+#define COND_INITIALIZER CONDITION_VARIABLE_INIT
+static inline int cond_init(cond_t *cond) {
+  InitializeConditionVariable(cond);
+  return 0;
+}
+static inline int cond_wait(cond_t *cond, mutex_t *mutex) {
+  return !SleepConditionVariableSRW(cond, mutex, INFINITE, 0);
+}
+static inline int cond_timedwait(cond_t *cond, mutex_t *mutex,
+                                 unsigned long ms) {
+  return !SleepConditionVariableSRW(cond, mutex, ms, 0);
+}
+static inline int cond_signal(cond_t *cond) {
+  WakeConditionVariable(cond);
+  return 0;
+}
+static inline int cond_broadcast(cond_t *cond) {
+  WakeAllConditionVariable(cond);
+  return 0;
+}
+static inline int cond_destroy(cond_t *cond) { return 0; }
+
 #else
 // On other platforms use <pthread.h>
 #include <pthread.h>
+#include <time.h>
 
 #define mutex_t pthread_mutex_t
 #define MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
@@ -33,6 +58,25 @@ static inline int mutex_init(mutex_t *mutex) { return pthread_mutex_init(mutex,
 static inline int mutex_lock(mutex_t *mutex) { return pthread_mutex_lock(mutex); }
 static inline int mutex_unlock(mutex_t *mutex) { return pthread_mutex_unlock(mutex); }
 static inline int mutex_destroy(mutex_t *mutex) { return pthread_mutex_destroy(mutex); }
+
+#define cond_t pthread_cond_t
+#define COND_INITIALIZER PTHREAD_COND_INITIALIZER
+static inline int cond_init(cond_t *cond) { return pthread_cond_init(cond, NULL); }
+static inline int cond_wait(cond_t *cond, mutex_t *mutex) { return pthread_cond_wait(cond, mutex); }
+static inline int cond_timedwait(cond_t *cond, mutex_t *mutex, unsigned long ms) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += (long)(ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  return pthread_cond_timedwait(cond, mutex, &ts);
+}
+static inline int cond_signal(cond_t *cond) { return pthread_cond_signal(cond); }
+static inline int cond_broadcast(cond_t *cond) { return pthread_cond_broadcast(cond); }
+static inline int cond_destroy(cond_t *cond) { return pthread_cond_destroy(cond); }
 #endif
 
 #endif // MUTEX_INCLUDE
\ No newline at end of file
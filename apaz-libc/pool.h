@@ -0,0 +1,226 @@
+#ifndef POOL_INCLUDE
+#define POOL_INCLUDE
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+#include "mutex.h"
+
+// POOL_DEFINE(type) defines Pool_##type, an allocator for objects of just that
+// type. Freed objects go on a list threaded through the objects themselves,
+// and are handed back out first. New objects are bumped off an Arena. Both are
+// O(1), and neither takes a lock or calls malloc() once the arena has chunks
+// to spare.
+//
+// A pool belongs to one thread at a time. Pool_##type##_local() gives each
+// thread a pool of its own, which is never freed. To share objects between
+// threads, or to get the memory back from threads that come and go, use a
+// Pool_##type##_Shared with a Pool_##type##_Cache on each thread instead.
+
+// How many objects' worth of memory the pool's first arena chunk holds.
+#ifndef POOL_FIRST_OBJECTS
+#define POOL_FIRST_OBJECTS 64
+#endif
+
+// How many objects a Pool_##type##_Cache takes from its shared pool at once.
+// It keeps up to twice that many before giving a batch back.
+#ifndef POOL_CACHE_BATCH
+#define POOL_CACHE_BATCH 32
+#endif
+
+/******************************************************************************/
+#define POOL_DEFINE(type)                                                      \
+  union Pool_##type##_Slot;                                                    \
+  typedef union Pool_##type##_Slot Pool_##type##_Slot;                         \
+  union Pool_##type##_Slot {                                                   \
+    type item;                                                                 \
+    Pool_##type##_Slot *next_free;                                             \
+  };                                                                           \
+                                                                               \
+  struct Pool_##type;                                                          \
+  typedef struct Pool_##type Pool_##type;                                      \
+  struct Pool_##type {                                                         \
+    Pool_##type##_Slot *free_list;                                             \
+    Arena arena;                                                               \
+  };                                                                           \
+                                                                               \
+  static inline Pool_##type *Pool_##type##_init(Pool_##type *pool) {           \
+    pool->free_list = NULL;                                                    \
+    Arena_init(&(pool->arena), (char *)"Pool_" #type, NULL, 0);                \
+    /* Start small, then leave it to the arena to grow. */                     \
+    pool->arena.next_cap = sizeof(Pool_##type##_Slot) * POOL_FIRST_OBJECTS;    \
+    return pool;                                                               \
+  }                                                                            \
+                                                                               \
+  /**                                                                          \
+   * Frees every object allocated from the pool, along with the pool's memory. \
+   */                                                                          \
+  static inline void Pool_##type##_destroy(Pool_##type *pool) {                \
+    pool->free_list = NULL;                                                    \
+    Arena_destroy(&(pool->arena), false, false);                               \
+  }                                                                            \
+                                                                               \
+  /**                                                                          \
+   * Frees every object allocated from the pool at once. The memory is kept to \
+   * allocate from again.                                                      \
+   */                                                                          \
+  static inline void Pool_##type##_reset(Pool_##type *pool) {                  \
+    pool->free_list = NULL;                                                    \
+    Arena_reset(&(pool->arena));                                               \
+  }                                                                            \
+                                                                               \
+  /**                                                                          \
+   * Returns an uninitialized object, to be given back with                    \
+   * Pool_##type##_free().                                                     \
+   */                                                                          \
+  static inline type *Pool_##type##_alloc(Pool_##type *pool) {                 \
+    Pool_##type##_Slot *slot = pool->free_list;                                \
+    if (slot) {                                                                \
+      pool->free_list = slot->next_free;                                       \
+      return &(slot->item);                                                    \
+    }                                                                          \
+    slot = Arena_malloc_array_of(&(pool->arena), Pool_##type##_Slot, 1);       \
+    return &(slot->item);                                                      \
+  }                                                                            \
+                                                                               \
+  /**                                                                          \
+   * Gives an object back to the pool it came from.                            \
+   */                                                                          \
+  static inline void Pool_##type##_free(Pool_##type *pool, type *item) {       \
+    Pool_##type##_Slot *slot = (Pool_##type##_Slot *)item;                     \
+    slot->next_free = pool->free_list;                                         \
+    pool->free_list = slot;                                                    \
+  }                                                                            \
+                                                                               \
+  /**                                                                          \
+   * The calling thread's own pool, made on first use. Objects from it must be \
+   * freed on the same thread. It lives as long as the thread does, and isn't  \
+   * freed when the thread exits, so it's for long-lived threads. Otherwise,   \
+   * use Pool_##type##_Shared.                                                 \
+   */                                                                          \
+  static inline Pool_##type *Pool_##type##_local(void) {                       \
+    static _Thread_local Pool_##type local;                                    \
+    static _Thread_local bool local_ready = false;                             \
+    if (!local_ready) {                                                        \
+      Pool_##type##_init(&local);                                              \
+      local_ready = true;                                                      \
+    }                                                                          \
+    return &local;                                                             \
+  }                                                                            \
+                                                                               \
+  /**                                                                          \
+   * Pool_##type##_Shared is a pool any number of threads can use at once,     \
+   * through a Pool_##type##_Cache each. Caches take and give back objects     \
+   * POOL_CACHE_BATCH at a time, so the shared pool's lock is only taken once  \
+   * per batch. An object can be freed to any cache of the same shared pool,   \
+   * not just the one it came from, and the memory belongs to the shared pool. \
+   */                                                                          \
+  struct Pool_##type##_Shared;                                                 \
+  typedef struct Pool_##type##_Shared Pool_##type##_Shared;                    \
+  struct Pool_##type##_Shared {                                                \
+    mutex_t mutex;                                                             \
+    Pool_##type pool;                                                          \
+  };                                                                           \
+                                                                               \
+  struct Pool_##type##_Cache;                                                  \
+  typedef struct Pool_##type##_Cache Pool_##type##_Cache;                      \
+  struct Pool_##type##_Cache {                                                 \
+    Pool_##type##_Shared *shared;                                              \
+    Pool_##type##_Slot *free_list;                                             \
+    size_t num_free;                                                           \
+  };                                                                           \
+                                                                               \
+  static inline Pool_##type##_Shared *Pool_##type##_Shared_init(               \
+      Pool_##type##_Shared *shared) {                                          \
+    mutex_init(&(shared->mutex));                                              \
+    Pool_##type##_init(&(shared->pool));                                       \
+    return shared;                                                             \
+  }                                                                            \
+                                                                               \
+  /**                                                                          \
+   * Frees every object allocated from the shared pool, along with its memory. \
+   * Only destroy once no cache is in use.                                     \
+   */                                                                          \
+  static inline void Pool_##type##_Shared_destroy(                             \
+      Pool_##type##_Shared *shared) {                                          \
+    Pool_##type##_destroy(&(shared->pool));                                    \
+    mutex_destroy(&(shared->mutex));                                           \
+  }                                                                            \
+                                                                               \
+  static inline Pool_##type##_Cache *Pool_##type##_Cache_init(                 \
+      Pool_##type##_Cache *cache, Pool_##type##_Shared *shared) {              \
+    cache->shared = shared;                                                    \
+    cache->free_list = NULL;                                                   \
+    cache->num_free = 0;                                                       \
+    return cache;                                                              \
+  }                                                                            \
+                                                                               \
+  /**                                                                          \
+   * Gives everything in the cache back to the shared pool. Do this before the \
+   * thread using the cache goes away, or its objects are only reclaimed when  \
+   * the shared pool is destroyed.                                             \
+   */                                                                          \
+  static inline void Pool_##type##_Cache_flush(Pool_##type##_Cache *cache) {   \
+    if (!cache->free_list)                                                     \
+      return;                                                                  \
+    mutex_lock(&(cache->shared->mutex));                                       \
+    while (cache->free_list) {                                                 \
+      Pool_##type##_Slot *slot = cache->free_list;                             \
+      cache->free_list = slot->next_free;                                      \
+      Pool_##type##_free(&(cache->shared->pool), &(slot->item));               \
+    }                                                                          \
+    mutex_unlock(&(cache->shared->mutex));                                     \
+    cache->num_free = 0;                                                       \
+  }                                                                            \
+                                                                               \
+  /**                                                                          \
+   * Returns an uninitialized object, to be given back with                    \
+   * Pool_##type##_Cache_free().                                               \
+   */                                                                          \
+  static inline type *Pool_##type##_Cache_alloc(Pool_##type##_Cache *cache) {  \
+    if (!cache->free_list) {                                                   \
+      /* Refill the cache from the shared pool. */                             \
+      mutex_lock(&(cache->shared->mutex));                                     \
+      for (size_t i = 0; i < POOL_CACHE_BATCH; i++) {                          \
+        Pool_##type##_Slot *slot =                                             \
+            (Pool_##type##_Slot *)Pool_##type##_alloc(&(cache->shared->pool)); \
+        slot->next_free = cache->free_list;                                    \
+        cache->free_list = slot;                                               \
+      }                                                                        \
+      mutex_unlock(&(cache->shared->mutex));                                   \
+      cache->num_free = POOL_CACHE_BATCH;                                      \
+    }                                                                          \
+                                                                               \
+    Pool_##type##_Slot *slot = cache->free_list;                               \
+    cache->free_list = slot->next_free;                                        \
+    cache->num_free--;                                                         \
+    return &(slot->item);                                                      \
+  }                                                                            \
+                                                                               \
+  /**                                                                          \
+   * Gives an object back, to any cache of the shared pool it came from.       \
+   */                                                                          \
+  static inline void Pool_##type##_Cache_free(Pool_##type##_Cache *cache,      \
+                                              type *item) {                    \
+    Pool_##type##_Slot *slot = (Pool_##type##_Slot *)item;                     \
+    slot->next_free = cache->free_list;                                        \
+    cache->free_list = slot;                                                   \
+    cache->num_free++;                                                         \
+                                                                               \
+    if (cache->num_free > 2 * POOL_CACHE_BATCH) {                              \
+      /* Hand a batch back, so that objects freed here but allocated           \
+         elsewhere make their way back to the threads allocating them. */      \
+      mutex_lock(&(cache->shared->mutex));                                     \
+      for (size_t i = 0; i < POOL_CACHE_BATCH; i++) {                          \
+        Pool_##type##_Slot *give = cache->free_list;                           \
+        cache->free_list = give->next_free;                                    \
+        Pool_##type##_free(&(cache->shared->pool), &(give->item));             \
+      }                                                                        \
+      mutex_unlock(&(cache->shared->mutex));                                   \
+      cache->num_free -= POOL_CACHE_BATCH;                                     \
+    }                                                                          \
+  }                                                                            \
+  /****************************************************************************/
+
+#endif // POOL_INCLUDE
@@ -0,0 +1,206 @@
+#ifndef SHAREDARENA_INCLUDE
+#define SHAREDARENA_INCLUDE
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "mutex.h"
+
+// An arena that any number of threads can allocate from at once, so that
+// tasks working in parallel can build one structure and free it all together.
+// Allocating is an atomic add to the current chunk's size. Only moving on to
+// a new chunk takes the lock.
+//
+// Chunks grow and are kept across resets like with Arena, and the sizes are
+// the same ARENA_SIZE and ARENA_MAX_CHUNK_SIZE. There's no MEMDEBUG record of
+// the allocations.
+
+/**********************/
+/* Struct definitions */
+/**********************/
+
+struct SharedArenaChunk;
+typedef struct SharedArenaChunk SharedArenaChunk;
+struct SharedArenaChunk {
+  SharedArenaChunk *next;
+  size_t cap;
+
+  // How much of the chunk has been claimed. Goes past cap when allocations
+  // that didn't fit are turned away.
+  _Atomic size_t used;
+};
+
+struct SharedArena;
+typedef struct SharedArena SharedArena;
+struct SharedArena {
+  char *name;
+
+  // The chunk being allocated from, or NULL before the first allocation.
+  _Atomic(SharedArenaChunk *) current;
+
+  // Guards the rest. Chunks are in the order they're used, and the ones after
+  // current are empty, kept from before a reset.
+  mutex_t mutex;
+  SharedArenaChunk *chunks;
+  SharedArenaChunk *oversize;
+  size_t next_cap;
+};
+
+/*********************/
+/* SharedArena setup */
+/*********************/
+
+static inline SharedArena *SharedArena_init(SharedArena *arena, char *name) {
+  arena->name = name;
+  atomic_init(&(arena->current), NULL);
+  mutex_init(&(arena->mutex));
+  arena->chunks = NULL;
+  arena->oversize = NULL;
+  arena->next_cap = ARENA_SIZE;
+  return arena;
+}
+
+static inline void _SharedArenaChunk_free_all(SharedArenaChunk *chunk) {
+  while (chunk) {
+    SharedArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+}
+
+// Only destroy once nobody is allocating.
+static inline void SharedArena_destroy(SharedArena *arena) {
+  _SharedArenaChunk_free_all(arena->chunks);
+  _SharedArenaChunk_free_all(arena->oversize);
+  arena->chunks = NULL;
+  arena->oversize = NULL;
+  atomic_store_explicit(&(arena->current), NULL, memory_order_relaxed);
+  mutex_destroy(&(arena->mutex));
+}
+
+// Frees everything allocated on the arena at once, keeping the chunks to be
+// used again. Only reset once nobody is allocating, for example after waiting
+// on the tasks that were.
+static inline void SharedArena_reset(SharedArena *arena) {
+  mutex_lock(&(arena->mutex));
+  _SharedArenaChunk_free_all(arena->oversize);
+  arena->oversize = NULL;
+  for (SharedArenaChunk *chunk = arena->chunks; chunk; chunk = chunk->next)
+    atomic_store_explicit(&(chunk->used), 0, memory_order_relaxed);
+  atomic_store_explicit(&(arena->current), arena->chunks,
+                        memory_order_release);
+  mutex_unlock(&(arena->mutex));
+}
+
+/**************************/
+/* SharedArena allocation */
+/**************************/
+
+// Chunk buffers start after the header, aligned like malloc().
+#define _SHAREDARENA_CHUNK_HEADER                                              \
+  _roundToAlignment(sizeof(SharedArenaChunk), ALIGNOF(max_align_t))
+
+static inline char *_SharedArenaChunk_buffer(SharedArenaChunk *chunk) {
+  return ((char *)chunk) + _SHAREDARENA_CHUNK_HEADER;
+}
+
+static inline SharedArenaChunk *_SharedArenaChunk_new(SharedArena *arena,
+                                                      size_t cap) {
+  (void)arena;
+  SharedArenaChunk *chunk =
+      (SharedArenaChunk *)malloc(_SHAREDARENA_CHUNK_HEADER + cap);
+#if APAZ_HANDLE_UNLIKELY_ERRORS && !MEMDEBUG
+  if (!chunk) {
+    printf("Out of memory allocating arena %s.\n", arena->name);
+    exit(1);
+  }
+#endif
+  chunk->next = NULL;
+  chunk->cap = cap;
+  atomic_init(&(chunk->used), 0);
+  return chunk;
+}
+
+// Called when full is too full for need more bytes. Moves the arena on to a
+// chunk with room, unless somebody else already has.
+static inline void _SharedArena_grow(SharedArena *arena,
+                                     SharedArenaChunk *full, size_t need) {
+  mutex_lock(&(arena->mutex));
+  if (atomic_load_explicit(&(arena->current), memory_order_relaxed) != full) {
+    mutex_unlock(&(arena->mutex));
+    return;
+  }
+
+  // Same as Arena. Use the next chunk if it was kept from before a reset and
+  // fits. Otherwise make one, bigger than the last.
+  SharedArenaChunk **link = full ? &(full->next) : &(arena->chunks);
+  SharedArenaChunk *chunk = *link;
+  if (!chunk || chunk->cap < need) {
+    while (arena->next_cap < need)
+      arena->next_cap *= 2;
+    chunk = _SharedArenaChunk_new(arena, arena->next_cap);
+    chunk->next = *link;
+    *link = chunk;
+    arena->next_cap = arena->next_cap * 2 < ARENA_MAX_CHUNK_SIZE
+                          ? arena->next_cap * 2
+                          : ARENA_MAX_CHUNK_SIZE;
+  }
+
+  // Publish the chunk. Its size was zeroed before this.
+  atomic_store_explicit(&(arena->current), chunk, memory_order_release);
+  mutex_unlock(&(arena->mutex));
+}
+
+// Allocates num_bytes aligned to align, a power of two. Safe to call from any
+// number of threads at once.
+static inline void *SharedArena_malloc_aligned(SharedArena *arena,
+                                               size_t num_bytes,
+                                               size_t align) {
+  // Claim whole multiples of malloc()'s alignment, so that every claim starts
+  // out aligned like that, plus whatever it takes to align further.
+  size_t need = _roundToAlignment(num_bytes, ALIGNOF(max_align_t));
+  if (align > ALIGNOF(max_align_t))
+    need += align - ALIGNOF(max_align_t);
+
+  // Big allocations get a chunk of their own.
+  if (need > ARENA_MAX_CHUNK_SIZE / 4) {
+    SharedArenaChunk *big = _SharedArenaChunk_new(arena, need);
+    mutex_lock(&(arena->mutex));
+    big->next = arena->oversize;
+    arena->oversize = big;
+    mutex_unlock(&(arena->mutex));
+    return (void *)_Arena_align_up((uintptr_t)_SharedArenaChunk_buffer(big),
+                                   align);
+  }
+
+  while (true) {
+    SharedArenaChunk *chunk =
+        atomic_load_explicit(&(arena->current), memory_order_acquire);
+    if (chunk) {
+      size_t start = atomic_fetch_add_explicit(&(chunk->used), need,
+                                               memory_order_relaxed);
+      if (start + need <= chunk->cap)
+        return (void *)_Arena_align_up(
+            (uintptr_t)(_SharedArenaChunk_buffer(chunk) + start), align);
+    }
+    _SharedArena_grow(arena, chunk, need);
+  }
+}
+
+// Allocates like malloc(), aligned for any type.
+static inline void *SharedArena_malloc(SharedArena *arena, size_t num_bytes) {
+  return SharedArena_malloc_aligned(arena, num_bytes, ALIGNOF(max_align_t));
+}
+
+#define SharedArena_malloc_of(arena, type)                                     \
+  ((type *)SharedArena_malloc_aligned(arena, sizeof(type), ALIGNOF(type)))
+#define SharedArena_malloc_array_of(arena, type, n)                            \
+  ((type *)SharedArena_malloc_aligned(arena, sizeof(type) * (n),               \
+                                      ALIGNOF(type)))
+
+#endif // SHAREDARENA_INCLUDE
@@ -142,6 +142,25 @@ static inline bool String_contains(String str, char *subseq);
 static inline String String_toUpper(String str);
 static inline String String_toLower(String str);
 
+// The same, but allocating on an arena. Strings made on an arena are freed with
+// it, so don't String_destroy() them.
+#define String_new_on(arena, len)                                              \
+  _String_new_on(arena, len, __LINE__, __func__, __FILE__)
+#define String_new_of_on(arena, cstr, len)                                     \
+  _String_new_of_on(arena, cstr, len, __LINE__, __func__, __FILE__)
+#define String_new_of_strlen_on(arena, cstr)                                   \
+  _String_new_of_on(arena, cstr, apaz_strlen(cstr), __LINE__, __func__,        \
+                    __FILE__)
+#define String_resize_on(arena, str, new_size)                                 \
+  _String_resize_on(arena, str, new_size, __LINE__, __func__, __FILE__)
+#define String_add_on(arena, str1, str2)                                       \
+  _String_add_on(arena, str1, str2, __LINE__, __func__, __FILE__)
+#define String_append_on(arena, base, to_append)                               \
+  _String_append_on(arena, base, to_append, __LINE__, __func__, __FILE__)
+#define String_clone_on(arena, to_clone)                                       \
+  _String_new_of_on(arena, to_clone, String_len(to_clone), __LINE__, __func__, \
+                    __FILE__)
+
 // #define                String_regexCompile(expr)
 // static inline bool     String_regexMatches(String str, CompiledRegEx regex);
 
@@ -320,6 +339,67 @@ static inline String String_toLower(String str) {
   return original;
 }
 
+/**************************/
+/* Arena String Functions */
+/**************************/
+
+static inline String _String_new_on(Arena *arena, size_t len, size_t line,
+                                    const char *func, const char *file) {
+  void *ptr = _Arena_malloc(arena, sizeof(size_t) + len + 1, line, func, file);
+  *((size_t *)ptr) = len;
+  String data = ((String)ptr) + sizeof(size_t);
+  data[len] = '\0';
+  return data;
+}
+
+static inline String _String_new_of_on(Arena *arena, char *cstr, size_t len,
+                                       size_t line, const char *func,
+                                       const char *file) {
+  String nstr = _String_new_on(arena, len, line, func, file);
+  for (size_t i = 0; i < len; i++)
+    nstr[i] = cstr[i];
+  return nstr;
+}
+
+// Resizes in place if the string is the last thing allocated on the arena.
+static inline String _String_resize_on(Arena *arena, String str,
+                                       size_t new_size, size_t line,
+                                       const char *func, const char *file) {
+  void *ptr = str - sizeof(size_t);
+  ptr = _Arena_realloc(arena, ptr, sizeof(size_t) + String_len(str) + 1,
+                       sizeof(size_t) + new_size + 1, line, func, file);
+  *((size_t *)ptr) = new_size;
+  String data = ((String)ptr) + sizeof(size_t);
+  data[new_size] = '\0';
+  return data;
+}
+
+// Returns str1str2 as a new string, leaving both alone.
+static inline String _String_add_on(Arena *arena, String str1, String str2,
+                                    size_t line, const char *func,
+                                    const char *file) {
+  size_t sl1 = String_len(str1), sl2 = String_len(str2);
+  String ns = _String_new_on(arena, sl1 + sl2, line, func, file);
+  for (size_t i = 0; i < sl1; i++)
+    ns[i] = str1[i];
+  for (size_t j = 0; j < sl2; j++)
+    ns[sl1 + j] = str2[j];
+  return ns;
+}
+
+// Appends to_append to base and returns base, which may have moved. Building
+// a string up this way doesn't copy it, as long as nothing else is allocated
+// on the arena in between.
+static inline String _String_append_on(Arena *arena, String base,
+                                       String to_append, size_t line,
+                                       const char *func, const char *file) {
+  size_t blen = String_len(base), alen = String_len(to_append);
+  base = _String_resize_on(arena, base, blen + alen, line, func, file);
+  for (size_t i = 0; i < alen; i++)
+    base[blen + i] = to_append[i];
+  return base;
+}
+
 /****************/
 /* File Reading */
 /****************/
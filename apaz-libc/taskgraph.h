@@ -0,0 +1,276 @@
+#ifndef TASKGRAPH_INCLUDE
+#define TASKGRAPH_INCLUDE
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "threadpool.h"
+
+// A graph of tasks with dependencies between them. Build it with
+// TaskGraph_add() and TaskGraph_depend(), then run it on a pool as many times
+// as you like. Each task is submitted as soon as the last of the tasks it
+// depends on finishes. Nothing is locked to do so, just an atomic count of
+// unfinished dependencies on each task.
+//
+// Don't change a graph while it's running.
+
+/**********************/
+/* Struct definitions */
+/**********************/
+
+struct TaskGraph;
+typedef struct TaskGraph TaskGraph;
+
+struct TaskGraphNode;
+typedef struct TaskGraphNode TaskGraphNode;
+struct TaskGraphNode {
+  void (*task_fn)(void *args);
+  void *task_args;
+  TaskGraph *graph;
+  size_t num_deps;
+  _Atomic size_t deps_left;
+};
+
+struct TaskGraph {
+  TaskGraphNode *nodes;
+  size_t num_nodes;
+  size_t cap_nodes;
+
+  // Dependencies as they were declared, edge_from[i] before edge_to[i].
+  size_t *edge_from;
+  size_t *edge_to;
+  size_t num_edges;
+  size_t cap_edges;
+
+  // The same edges grouped by the task they come from. Task i is followed by
+  // succ[succ_start[i]] through succ[succ_start[i + 1] - 1]. Rebuilt before
+  // the next run when the graph changes.
+  size_t *succ_start;
+  size_t *succ;
+  bool dirty;
+  bool acyclic;
+
+  Threadpool *pool;
+  WaitGroup wait_group;
+};
+
+/*******************/
+/* Building graphs */
+/*******************/
+
+static inline void TaskGraph_init(TaskGraph *graph) {
+  graph->nodes = NULL;
+  graph->num_nodes = 0;
+  graph->cap_nodes = 0;
+  graph->edge_from = NULL;
+  graph->edge_to = NULL;
+  graph->num_edges = 0;
+  graph->cap_edges = 0;
+  graph->succ_start = NULL;
+  graph->succ = NULL;
+  graph->dirty = true;
+  graph->acyclic = true;
+  graph->pool = NULL;
+  WaitGroup_init(&(graph->wait_group));
+}
+
+// Only destroy once the graph is done running.
+static inline void TaskGraph_destroy(TaskGraph *graph) {
+  free(graph->nodes);
+  free(graph->edge_from);
+  free(graph->edge_to);
+  free(graph->succ_start);
+  free(graph->succ);
+  WaitGroup_destroy(&(graph->wait_group));
+}
+
+// Returned by TaskGraph_add() when it's out of memory. It isn't the id of any
+// task, so TaskGraph_depend() rejects it.
+#define TASKGRAPH_NONE SIZE_MAX
+
+// Adds a task, and returns its id for TaskGraph_depend(). Returns
+// TASKGRAPH_NONE and leaves the graph as it was if it can't grow.
+static inline size_t TaskGraph_add(TaskGraph *graph,
+                                   void (*task_fn)(void *args),
+                                   void *task_args) {
+  if (graph->num_nodes == graph->cap_nodes) {
+    size_t cap = graph->cap_nodes ? graph->cap_nodes * 2 : 16;
+    TaskGraphNode *nodes =
+        (TaskGraphNode *)realloc(graph->nodes, cap * sizeof(TaskGraphNode));
+    if (!nodes)
+      return TASKGRAPH_NONE;
+    graph->nodes = nodes;
+    graph->cap_nodes = cap;
+  }
+
+  TaskGraphNode *node = graph->nodes + graph->num_nodes;
+  node->task_fn = task_fn;
+  node->task_args = task_args;
+  node->graph = graph;
+  node->num_deps = 0;
+  atomic_init(&(node->deps_left), 0);
+  graph->dirty = true;
+  return graph->num_nodes++;
+}
+
+// Task `task` won't start until task `on` has finished. Returns false and
+// leaves the graph as it was if either isn't a task in this graph, or if it
+// can't grow.
+static inline bool TaskGraph_depend(TaskGraph *graph, size_t task, size_t on) {
+  if (task >= graph->num_nodes || on >= graph->num_nodes)
+    return false;
+
+  if (graph->num_edges == graph->cap_edges) {
+    size_t cap = graph->cap_edges ? graph->cap_edges * 2 : 16;
+    size_t *edge_from =
+        (size_t *)realloc(graph->edge_from, cap * sizeof(size_t));
+    if (!edge_from)
+      return false;
+    graph->edge_from = edge_from;
+    size_t *edge_to = (size_t *)realloc(graph->edge_to, cap * sizeof(size_t));
+    if (!edge_to)
+      return false;
+    graph->edge_to = edge_to;
+    graph->cap_edges = cap;
+  }
+
+  graph->edge_from[graph->num_edges] = on;
+  graph->edge_to[graph->num_edges] = task;
+  graph->num_edges++;
+  graph->nodes[task].num_deps++;
+  graph->dirty = true;
+  return true;
+}
+
+// Groups the edges by the task they come from, and checks for cycles.
+// Returns false if it's out of memory, and the graph stays dirty.
+static inline bool _TaskGraph_build(TaskGraph *graph) {
+  size_t n = graph->num_nodes;
+  free(graph->succ_start);
+  free(graph->succ);
+  graph->succ_start = (size_t *)malloc((n + 1) * sizeof(size_t));
+  graph->succ = (size_t *)malloc((graph->num_edges + 1) * sizeof(size_t));
+  size_t *fill = (size_t *)malloc((n + 1) * sizeof(size_t));
+  if (!graph->succ_start || !graph->succ || !fill) {
+    free(fill);
+    return false;
+  }
+  memset(graph->succ_start, 0, (n + 1) * sizeof(size_t));
+
+  // Counting sort on the source of each edge.
+  for (size_t e = 0; e < graph->num_edges; e++)
+    graph->succ_start[graph->edge_from[e] + 1]++;
+  for (size_t i = 0; i < n; i++)
+    graph->succ_start[i + 1] += graph->succ_start[i];
+  memcpy(fill, graph->succ_start, (n + 1) * sizeof(size_t));
+  for (size_t e = 0; e < graph->num_edges; e++)
+    graph->succ[fill[graph->edge_from[e]]++] = graph->edge_to[e];
+
+  // Kahn's algorithm. If it can't order every task, there's a cycle, and the
+  // graph would never finish. Reuses fill as the work list and deps_left as
+  // scratch.
+  size_t head = 0, tail = 0;
+  for (size_t i = 0; i < n; i++) {
+    atomic_store_explicit(&(graph->nodes[i].deps_left),
+                          graph->nodes[i].num_deps, memory_order_relaxed);
+    if (!graph->nodes[i].num_deps)
+      fill[tail++] = i;
+  }
+  while (head < tail) {
+    size_t i = fill[head++];
+    for (size_t s = graph->succ_start[i]; s < graph->succ_start[i + 1]; s++)
+      if (atomic_fetch_sub_explicit(&(graph->nodes[graph->succ[s]].deps_left),
+                                    1, memory_order_relaxed) == 1)
+        fill[tail++] = graph->succ[s];
+  }
+  free(fill);
+
+  graph->acyclic = tail == n;
+  graph->dirty = false;
+  return true;
+}
+
+/******************/
+/* Running graphs */
+/******************/
+
+static inline void _TaskGraph_run_node(void *node_arg);
+
+// Submits a ready task, or runs it here if the pool won't take it.
+static inline void _TaskGraph_submit(TaskGraphNode *node) {
+  if (!Threadpool_exectask(node->graph->pool, _TaskGraph_run_node, node))
+    _TaskGraph_run_node(node);
+}
+
+static inline void _TaskGraph_run_node(void *node_arg) {
+  TaskGraphNode *node = (TaskGraphNode *)node_arg;
+  TaskGraph *graph = node->graph;
+
+  while (node) {
+    node->task_fn(node->task_args);
+
+    // Release the tasks that were only waiting on this one. Keep one of them
+    // to run next on this thread, since its inputs are hot in our cache.
+    size_t i = (size_t)(node - graph->nodes);
+    TaskGraphNode *next = NULL;
+    for (size_t s = graph->succ_start[i]; s < graph->succ_start[i + 1]; s++) {
+      TaskGraphNode *succ = graph->nodes + graph->succ[s];
+      if (atomic_fetch_sub_explicit(&(succ->deps_left), 1,
+                                    memory_order_acq_rel) != 1)
+        continue;
+      if (next)
+        _TaskGraph_submit(next);
+      next = succ;
+    }
+
+    WaitGroup_done(&(graph->wait_group));
+    node = next;
+  }
+}
+
+// Starts running the graph on the pool and returns without waiting for it.
+// Returns false without running anything if the graph has a cycle, or if
+// there isn't the memory to order its tasks.
+static inline bool TaskGraph_submit(TaskGraph *graph, Threadpool *pool) {
+  if (graph->dirty && !_TaskGraph_build(graph))
+    return false;
+  if (!graph->acyclic)
+    return false;
+  if (!graph->num_nodes)
+    return true;
+
+  // Rerunning only costs resetting the counts.
+  graph->pool = pool;
+  for (size_t i = 0; i < graph->num_nodes; i++)
+    atomic_store_explicit(&(graph->nodes[i].deps_left),
+                          graph->nodes[i].num_deps, memory_order_relaxed);
+  WaitGroup_add(&(graph->wait_group), graph->num_nodes);
+
+  // The count of each task has to be reset before any task can finish and
+  // release its successors, so find the roots in a second pass.
+  for (size_t i = 0; i < graph->num_nodes; i++)
+    if (!graph->nodes[i].num_deps)
+      _TaskGraph_submit(graph->nodes + i);
+  return true;
+}
+
+// Blocks until every task in a submitted graph has finished. Called from a
+// task in the same pool, this helps run the graph while it waits.
+static inline void TaskGraph_wait(TaskGraph *graph) {
+  if (graph->pool)
+    Threadpool_await(graph->pool, &(graph->wait_group));
+}
+
+// Runs the graph on the pool and waits for it to finish. Returns false
+// without running anything if TaskGraph_submit() would.
+static inline bool TaskGraph_run(TaskGraph *graph, Threadpool *pool) {
+  if (!TaskGraph_submit(graph, pool))
+    return false;
+  TaskGraph_wait(graph);
+  return true;
+}
+
+#endif // TASKGRAPH_INCLUDE
@@ -1,166 +1,2219 @@
 #ifndef THREADPOOL
 #define THREADPOOL
 
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-#include "../apaz-mutex.h/apaz-mutex.h"
+#ifdef __linux__
+#include <stdio.h>
+#include <sys/syscall.h>
+#endif
+
+#include "arena.h"
+#include "mutex.h"
 
 #define Threadpool_CRITICAL_BEGIN mutex_lock(&(pool->pool_mutex));
 #define Threadpool_CRITICAL_END mutex_unlock(&(pool->pool_mutex));
 
+// How many times an idle worker calls sched_yield() looking for work before it
+// parks on the pool's condition variable. The budget adapts per worker: it
+// grows while spinning keeps finding work and shrinks each time the worker has
+// to park. Set to 0 to always park immediately.
+#ifndef THREADPOOL_SPIN_ITERS
+#define THREADPOOL_SPIN_ITERS 64
+#endif
+
+// Capacity of each worker's deque. Must be a power of two. Tasks a worker
+// submits while its deque is full spill into the pool's shared queue.
+#ifndef THREADPOOL_DEQUE_CAP
+#define THREADPOOL_DEQUE_CAP 1024
+#endif
+_Static_assert((THREADPOOL_DEQUE_CAP & (THREADPOOL_DEQUE_CAP - 1)) == 0,
+               "THREADPOOL_DEQUE_CAP must be a power of two.");
+
+// Task nodes are allocated THREADPOOL_SLAB_NODES at a time and recycled, and
+// each worker caches up to twice THREADPOOL_NODE_BATCH of them so that
+// submitting from inside the pool doesn't need the pool's lock either.
+#ifndef THREADPOOL_SLAB_NODES
+#define THREADPOOL_SLAB_NODES 256
+#endif
+#ifndef THREADPOOL_NODE_BATCH
+#define THREADPOOL_NODE_BATCH 64
+#endif
+
+// Define THREADPOOL_NODE_MALLOC to 1 to malloc() and free() every task node
+// instead, the way it was before the slabs. Only useful for benchmarking.
+#ifndef THREADPOOL_NODE_MALLOC
+#define THREADPOOL_NODE_MALLOC 0
+#endif
+
+// Limits on the machine topology the pool understands. CPUs and NUMA nodes
+// numbered past these are never pinned to.
+#ifndef THREADPOOL_MAX_CPUS
+#define THREADPOOL_MAX_CPUS 1024
+#endif
+#ifndef THREADPOOL_MAX_NODES
+#define THREADPOOL_MAX_NODES 64
+#endif
+
+// Threads outside the pool look up which NUMA node they're on once every this
+// many submits, to pick the queue closest to them.
+#ifndef THREADPOOL_NODE_RECHECK
+#define THREADPOOL_NODE_RECHECK 256
+#endif
+
+// Every THREADPOOL_AGING_PERIOD-th task a worker picks up, it looks at a
+// lower priority before the higher ones, so that a steady stream of high
+// priority work can't starve the rest.
+#ifndef THREADPOOL_AGING_PERIOD
+#define THREADPOOL_AGING_PERIOD 16
+#endif
+
+// Set to 0 to compile out the counters behind Threadpool_stats().
+#ifndef THREADPOOL_STATS
+#define THREADPOOL_STATS 1
+#endif
+
+// Reading the clock costs more than a tiny task, so only one in every
+// THREADPOOL_LATENCY_SAMPLE tasks is timed for the latency histograms.
+#ifndef THREADPOOL_LATENCY_SAMPLE
+#define THREADPOOL_LATENCY_SAMPLE 16
+#endif
+
+// Bucket i of the latency histograms counts tasks that waited at least 2^i
+// and less than 2^(i + 1) nanoseconds to start. The last bucket takes
+// everything longer.
+#define THREADPOOL_LATENCY_BUCKETS 32
+
+#define THREADPOOL_CACHE_LINE 64
+
 /**********************/
 /* Struct definitions */
 /**********************/
 
+// Counts down outstanding tasks, so that callers can block until a group of
+// them has finished. See Threadpool_exectask_group().
+struct WaitGroup;
+typedef struct WaitGroup WaitGroup;
+struct WaitGroup {
+  _Atomic size_t count;
+  mutex_t mutex;
+  cond_t cond;
+};
+
+// Each priority has its own queues. Workers drain higher priorities first.
+// Tasks submitted with THREADPOOL_PRIO_INHERIT get the priority of the task
+// that submits them, or THREADPOOL_PRIO_NORMAL from outside the pool.
+enum ThreadpoolPriority {
+  THREADPOOL_PRIO_INHERIT = -1,
+  THREADPOOL_PRIO_HIGH = 0,
+  THREADPOOL_PRIO_NORMAL = 1,
+  THREADPOOL_PRIO_LOW = 2
+};
+typedef enum ThreadpoolPriority ThreadpoolPriority;
+#define THREADPOOL_PRIORITIES 3
+
 struct TaskStack;
 typedef struct TaskStack TaskStack;
 struct TaskStack {
   void (*task_fn)(void *args);
   void *task_args;
+  WaitGroup *wait_group;
+  ThreadpoolPriority priority;
+  // 0 unless sampled, or waiting in an elastic pool's shared queue.
+  uint64_t enqueued_ns;
+  bool sampled; // Counts towards the latency histogram.
   TaskStack *next;
 };
 
-struct Threadpool {
-  mutex_t pool_mutex;
-  TaskStack *task_stack;
+struct TaskSlab;
+typedef struct TaskSlab TaskSlab;
+struct TaskSlab {
+  TaskSlab *next;
+  TaskStack nodes[THREADPOOL_SLAB_NODES];
+};
+
+// A fixed size Chase-Lev work stealing deque. The owning worker pushes and
+// takes at the bottom without locking, and other workers steal from the top.
+struct TaskDeque;
+typedef struct TaskDeque TaskDeque;
+struct TaskDeque {
+  _Alignas(THREADPOOL_CACHE_LINE) _Atomic ptrdiff_t top;
+  _Alignas(THREADPOOL_CACHE_LINE) _Atomic ptrdiff_t bottom;
+  _Atomic(TaskStack *) buffer[THREADPOOL_DEQUE_CAP];
+};
+
+// The order each of the pool's queues hands out tasks in. LIFO runs the most
+// recently submitted task first, which keeps caches warm for recursive
+// workloads. FIFO runs the oldest first, which keeps tail latency down under
+// sustained load.
+enum ThreadpoolOrder { THREADPOOL_LIFO = 0, THREADPOOL_FIFO = 1 };
+typedef enum ThreadpoolOrder ThreadpoolOrder;
+
+// Where the pool's workers run. Unpinned workers go wherever the OS puts
+// them. THREADPOOL_PIN_CPUS pins worker i to config.cpus[i % num_cpus].
+// THREADPOOL_PIN_CORES pins one worker to each physical core, filling one
+// NUMA node before moving on to the next. Pinning only does anything on
+// Linux, and is ignored elsewhere.
+enum ThreadpoolPinning {
+  THREADPOOL_PIN_NONE = 0,
+  THREADPOOL_PIN_CPUS = 1,
+  THREADPOOL_PIN_CORES = 2
+};
+typedef enum ThreadpoolPinning ThreadpoolPinning;
+
+// What submitting to a full pool does. THREADPOOL_BLOCK waits for room,
+// THREADPOOL_FAIL returns false, and THREADPOOL_CALLER_RUNS runs the task on
+// the calling thread. Workers never block on their own pool, since that could
+// leave nobody to make room. They run the task themselves instead.
+enum ThreadpoolBackpressure {
+  THREADPOOL_BLOCK = 0,
+  THREADPOOL_FAIL = 1,
+  THREADPOOL_CALLER_RUNS = 2
+};
+typedef enum ThreadpoolBackpressure ThreadpoolBackpressure;
+
+// Options for Threadpool_create_with(). Start from Threadpool_config() and
+// change what you need.
+struct ThreadpoolConfig {
+  // With THREADPOOL_PIN_CORES, 0 means one worker per physical core.
   size_t num_threads;
-  size_t num_threads_running;
-  pthread_t *threads;
-  bool is_shutdown;
+  ThreadpoolOrder order;
+  ThreadpoolPinning pinning;
+  // For THREADPOOL_PIN_CPUS, num_cpus CPU numbers. Workers past those,
+  // including ones the pool grows to, start over from the first. With no
+  // CPUs, the workers aren't pinned.
+  const int *cpus;
+  size_t num_cpus;
+
+  // The pool starts with num_threads workers and grows up to max_threads
+  // when tasks in the shared queue have waited longer than grow_after_us and
+  // no worker is asleep. Workers that have slept for idle_timeout_ms retire,
+  // down to min_threads. 0 turns either off. By default the pool stays at
+  // num_threads. See also Threadpool_resize().
+  size_t min_threads;
+  size_t max_threads;
+  uint64_t grow_after_us;
+  uint64_t idle_timeout_ms;
+
+  // The most tasks that can be waiting to start at once. 0 means no limit.
+  size_t capacity;
+  ThreadpoolBackpressure backpressure;
 };
+typedef struct ThreadpoolConfig ThreadpoolConfig;
+
+struct Threadpool;
 typedef struct Threadpool Threadpool;
 
+// The shared queues for tasks submitted from outside the pool, one for each
+// priority on each NUMA node the workers are pinned to. Tasks go to the
+// submitter's node, and that node's workers look there before they go looking
+// anywhere else. Guarded by pool_mutex, but num_injected can be peeked without
+// it to skip locking when it's empty.
+struct ThreadpoolNode;
+typedef struct ThreadpoolNode ThreadpoolNode;
+struct ThreadpoolNode {
+  _Alignas(THREADPOOL_CACHE_LINE) TaskStack
+      *task_queue_head[THREADPOOL_PRIORITIES];
+  TaskStack *task_queue_tail[THREADPOOL_PRIORITIES];
+  _Atomic size_t num_injected[THREADPOOL_PRIORITIES];
+  size_t num_workers;
+  int os_node; // -1 when the workers aren't pinned.
+};
+
+// What the threads in a worker slot have been up to since the pool was
+// created. Time only counts while there's a thread in the slot. Idle time
+// counts time spent looking for work, spinning and sleeping included, and busy
+// time everything else. Steals count tasks taken from other workers' deques.
+// The latency histogram only counts the sampled tasks.
+struct ThreadpoolWorkerStats;
+typedef struct ThreadpoolWorkerStats ThreadpoolWorkerStats;
+struct ThreadpoolWorkerStats {
+  uint64_t tasks_run;
+  uint64_t busy_ns;
+  uint64_t idle_ns;
+  uint64_t steals;
+  uint64_t latency_ns[THREADPOOL_LATENCY_BUCKETS];
+};
+
+// A snapshot of the whole pool, from Threadpool_stats(). The counters are
+// summed over the worker slots, so workers that retired still count for what
+// they did. Queued counts tasks waiting to start.
+struct ThreadpoolStats;
+typedef struct ThreadpoolStats ThreadpoolStats;
+struct ThreadpoolStats {
+  size_t num_threads;
+  size_t num_sleeping;
+  size_t queued;
+  ThreadpoolWorkerStats totals;
+};
+
+// Only the owning worker writes these, so plain loads and stores suffice.
+// They're atomic so that snapshots can read them while the worker runs.
+struct _ThreadpoolCounters;
+typedef struct _ThreadpoolCounters _ThreadpoolCounters;
+struct _ThreadpoolCounters {
+  _Atomic uint64_t tasks_run;
+  _Atomic uint64_t idle_ns;
+  _Atomic uint64_t idle_since_ns; // 0 while busy.
+  _Atomic uint64_t steals;
+  _Atomic uint64_t latency_ns[THREADPOOL_LATENCY_BUCKETS];
+  _Atomic uint64_t started_ns; // 0 while the slot has no thread.
+  _Atomic uint64_t lived_ns;   // How long earlier threads in the slot ran.
+};
+
+// Whether a worker slot has a thread in it. Retired threads have exited but
+// still have to be joined.
+enum _ThreadpoolSlot {
+  _THREADPOOL_SLOT_EMPTY = 0,
+  _THREADPOOL_SLOT_RUNNING = 1,
+  _THREADPOOL_SLOT_RETIRED = 2
+};
+typedef enum _ThreadpoolSlot _ThreadpoolSlot;
+
+struct ThreadpoolWorker;
+typedef struct ThreadpoolWorker ThreadpoolWorker;
+struct ThreadpoolWorker {
+  TaskDeque deques[THREADPOOL_PRIORITIES];
+  Threadpool *pool;
+  size_t id;
+  size_t node;
+  int cpu; // -1 when not pinned.
+  uint64_t rng;
+
+  // The priority of the task being run, and how many tasks have been picked
+  // up, for aging.
+  ThreadpoolPriority priority;
+  size_t picks;
+
+  // On their own cache lines, so that updating them doesn't slow down
+  // thieves reading the deques.
+  _Alignas(THREADPOOL_CACHE_LINE) _ThreadpoolCounters counters;
+  pthread_t thread;
+  _ThreadpoolSlot state; // Guarded by pool_mutex.
+
+  TaskStack *free_nodes;
+  size_t num_free_nodes;
+
+  // Scratch memory for tasks, rewound after each one.
+  Arena arena;
+};
+
+struct Threadpool {
+  mutex_t pool_mutex;
+  cond_t work_cond;
+
+  ThreadpoolOrder order;
+
+  // Tasks submitted from outside the pool.
+  ThreadpoolNode *nodes;
+  size_t num_nodes;
+
+  // Recycled task nodes, and the slabs they were carved from.
+  TaskStack *free_nodes;
+  TaskSlab *slabs;
+
+  // There's a slot for each of max_threads workers, and num_threads of them
+  // are running. Workers are started or retired to get to target_threads.
+  // Guarded by pool_mutex, but the atomics can be peeked without it.
+  ThreadpoolWorker *workers;
+  void *workers_alloc;
+  size_t max_threads;
+  size_t min_threads;
+  _Atomic size_t num_threads;
+  _Atomic size_t target_threads;
+  uint64_t grow_after_ns;
+  uint64_t idle_timeout_ms;
+
+  // Tasks submitted but not started yet, only counted when there's a
+  // capacity. Submitters waiting for room sleep on space_cond. Once the pool
+  // is shut down, the last of them to leave signals blocked_cond.
+  size_t capacity;
+  ThreadpoolBackpressure backpressure;
+  _Atomic size_t num_queued;
+  _Atomic size_t num_blocked;
+  cond_t space_cond;
+  cond_t blocked_cond;
+
+  // Sleeping workers are woken by bumping wake_epoch under pool_mutex.
+  _Atomic size_t num_threads_sleeping;
+  size_t wake_epoch;
+  _Atomic bool is_shutdown;
+
+  // Set by Threadpool_destroy_now(). Pending tasks are dropped, not run.
+  _Atomic bool drop_pending;
+};
+
+// The worker the current thread is, if it's a worker at all.
+static _Thread_local ThreadpoolWorker *_Threadpool_current_worker = NULL;
+
+#if THREADPOOL_STATS
+// How many tasks the current thread has submitted, for latency sampling.
+static _Thread_local size_t _Threadpool_submits = 0;
+#endif
+
+// The NUMA node the current thread last found itself on, and how many more
+// external submits can go by before it looks again.
+static _Thread_local int _Threadpool_os_node = -1;
+static _Thread_local size_t _Threadpool_os_node_ttl = 0;
+
+/*********************/
+/* WaitGroup methods */
+/*********************/
+
+static inline void WaitGroup_init(WaitGroup *wg) {
+  static mutex_t wgmut_init = MUTEX_INITIALIZER;
+  static cond_t wgcond_init = COND_INITIALIZER;
+  atomic_init(&(wg->count), 0);
+  wg->mutex = wgmut_init;
+  wg->cond = wgcond_init;
+}
+
+// Only destroy once nobody can be waiting on it anymore.
+static inline void WaitGroup_destroy(WaitGroup *wg) {
+  mutex_destroy(&(wg->mutex));
+  cond_destroy(&(wg->cond));
+}
+
+// Expect n more calls to WaitGroup_done().
+static inline void WaitGroup_add(WaitGroup *wg, size_t n) {
+  atomic_fetch_add_explicit(&(wg->count), n, memory_order_relaxed);
+}
+
+static inline void _WaitGroup_sub(WaitGroup *wg, size_t n) {
+  // Unless this brings the count to zero, there's nobody to wake.
+  size_t count = atomic_load_explicit(&(wg->count), memory_order_relaxed);
+  while (count > n)
+    if (atomic_compare_exchange_weak_explicit(&(wg->count), &count, count - n,
+                                              memory_order_release,
+                                              memory_order_relaxed))
+      return;
+
+  // The last decrement happens under the mutex, so that a waiter can't see
+  // zero, return, and destroy the group while we're still signalling it.
+  mutex_lock(&(wg->mutex));
+  atomic_fetch_sub_explicit(&(wg->count), n, memory_order_acq_rel);
+  cond_broadcast(&(wg->cond));
+  mutex_unlock(&(wg->mutex));
+}
+
+static inline void WaitGroup_done(WaitGroup *wg) { _WaitGroup_sub(wg, 1); }
+
+static inline bool WaitGroup_is_done(WaitGroup *wg) {
+  mutex_lock(&(wg->mutex));
+  bool done = !atomic_load_explicit(&(wg->count), memory_order_acquire);
+  mutex_unlock(&(wg->mutex));
+  return done;
+}
+
+// Block until the count reaches zero. To wait from inside a task, use
+// Threadpool_await() instead, which helps out while it waits.
+static inline void WaitGroup_wait(WaitGroup *wg) {
+  mutex_lock(&(wg->mutex));
+  while (atomic_load_explicit(&(wg->count), memory_order_acquire))
+    cond_wait(&(wg->cond), &(wg->mutex));
+  mutex_unlock(&(wg->mutex));
+}
+
+/*********************/
+/* TaskDeque methods */
+/*********************/
+
+static inline void _TaskDeque_init(TaskDeque *deque) {
+  atomic_init(&(deque->top), 0);
+  atomic_init(&(deque->bottom), 0);
+  for (size_t i = 0; i < THREADPOOL_DEQUE_CAP; i++)
+    atomic_init(&(deque->buffer[i]), NULL);
+}
+
+// Owner only. Returns false if the deque is full.
+static inline bool _TaskDeque_push(TaskDeque *deque, TaskStack *task) {
+  ptrdiff_t b = atomic_load_explicit(&(deque->bottom), memory_order_relaxed);
+  ptrdiff_t t = atomic_load_explicit(&(deque->top), memory_order_acquire);
+  if (b - t >= THREADPOOL_DEQUE_CAP)
+    return false;
+
+  atomic_store_explicit(&(deque->buffer[b & (THREADPOOL_DEQUE_CAP - 1)]), task,
+                        memory_order_relaxed);
+  atomic_store_explicit(&(deque->bottom), b + 1, memory_order_release);
+  return true;
+}
+
+// Owner only. How many more tasks can be pushed without failing.
+static inline size_t _TaskDeque_space(TaskDeque *deque) {
+  ptrdiff_t b = atomic_load_explicit(&(deque->bottom), memory_order_relaxed);
+  ptrdiff_t t = atomic_load_explicit(&(deque->top), memory_order_acquire);
+  return (size_t)(THREADPOOL_DEQUE_CAP - (b - t));
+}
+
+// Owner only. Takes the most recently pushed task, or returns NULL.
+static inline TaskStack *_TaskDeque_take(TaskDeque *deque) {
+  ptrdiff_t b =
+      atomic_load_explicit(&(deque->bottom), memory_order_relaxed) - 1;
+  atomic_store_explicit(&(deque->bottom), b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  ptrdiff_t t = atomic_load_explicit(&(deque->top), memory_order_relaxed);
+
+  TaskStack *task = NULL;
+  if (t <= b) {
+    task = atomic_load_explicit(&(deque->buffer[b & (THREADPOOL_DEQUE_CAP - 1)]),
+                                memory_order_relaxed);
+    if (t == b) {
+      // Last task. Race the thieves for it.
+      if (!atomic_compare_exchange_strong_explicit(&(deque->top), &t, t + 1,
+                                                   memory_order_seq_cst,
+                                                   memory_order_relaxed))
+        task = NULL;
+      atomic_store_explicit(&(deque->bottom), b + 1, memory_order_relaxed);
+    }
+  } else {
+    atomic_store_explicit(&(deque->bottom), b + 1, memory_order_relaxed);
+  }
+  return task;
+}
+
+// Any thread. Takes the oldest task, or returns NULL if the deque is empty or
+// another thread got to it first.
+static inline TaskStack *_TaskDeque_steal(TaskDeque *deque) {
+  ptrdiff_t t = atomic_load_explicit(&(deque->top), memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  ptrdiff_t b = atomic_load_explicit(&(deque->bottom), memory_order_acquire);
+
+  if (t < b) {
+    TaskStack *task = atomic_load_explicit(
+        &(deque->buffer[t & (THREADPOOL_DEQUE_CAP - 1)]), memory_order_relaxed);
+    if (atomic_compare_exchange_strong_explicit(&(deque->top), &t, t + 1,
+                                                memory_order_seq_cst,
+                                                memory_order_relaxed))
+      return task;
+  }
+  return NULL;
+}
+
+/********************/
+/* Task node caches */
+/********************/
+
+// Must hold pool_mutex.
+static inline TaskStack *_Threadpool_node_locked(Threadpool *pool) {
+#if THREADPOOL_NODE_MALLOC
+  (void)pool;
+  return (TaskStack *)malloc(sizeof(TaskStack));
+#endif
+  if (!pool->free_nodes) {
+    // Out of nodes. Carve up a new slab.
+    TaskSlab *slab = (TaskSlab *)malloc(sizeof(TaskSlab));
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    for (size_t i = 0; i < THREADPOOL_SLAB_NODES; i++) {
+      slab->nodes[i].next = pool->free_nodes;
+      pool->free_nodes = slab->nodes + i;
+    }
+  }
+
+  TaskStack *node = pool->free_nodes;
+  pool->free_nodes = node->next;
+  return node;
+}
+
+// Must hold pool_mutex.
+static inline void _Threadpool_free_node_locked(Threadpool *pool,
+                                                TaskStack *node) {
+#if THREADPOOL_NODE_MALLOC
+  (void)pool;
+  free(node);
+  return;
+#endif
+  node->next = pool->free_nodes;
+  pool->free_nodes = node;
+}
+
+// Owner only.
+static inline TaskStack *_ThreadpoolWorker_node(ThreadpoolWorker *self) {
+#if THREADPOOL_NODE_MALLOC
+  (void)self;
+  return (TaskStack *)malloc(sizeof(TaskStack));
+#endif
+  if (!self->free_nodes) {
+    // Refill the cache from the pool.
+    Threadpool *pool = self->pool;
+    Threadpool_CRITICAL_BEGIN;
+    for (size_t i = 0; i < THREADPOOL_NODE_BATCH; i++) {
+      TaskStack *node = _Threadpool_node_locked(pool);
+      node->next = self->free_nodes;
+      self->free_nodes = node;
+    }
+    Threadpool_CRITICAL_END;
+    self->num_free_nodes = THREADPOOL_NODE_BATCH;
+  }
+
+  TaskStack *node = self->free_nodes;
+  self->free_nodes = node->next;
+  self->num_free_nodes--;
+  return node;
+}
+
+// Owner only.
+static inline void _ThreadpoolWorker_free_node(ThreadpoolWorker *self,
+                                               TaskStack *node) {
+#if THREADPOOL_NODE_MALLOC
+  (void)self;
+  free(node);
+  return;
+#endif
+  node->next = self->free_nodes;
+  self->free_nodes = node;
+  self->num_free_nodes++;
+
+  if (self->num_free_nodes > 2 * THREADPOOL_NODE_BATCH) {
+    // Hand a batch back, so that nodes consumed here but submitted from
+    // elsewhere make their way back to the submitters.
+    Threadpool *pool = self->pool;
+    Threadpool_CRITICAL_BEGIN;
+    for (size_t i = 0; i < THREADPOOL_NODE_BATCH; i++) {
+      TaskStack *give = self->free_nodes;
+      self->free_nodes = give->next;
+      _Threadpool_free_node_locked(pool, give);
+    }
+    Threadpool_CRITICAL_END;
+    self->num_free_nodes -= THREADPOOL_NODE_BATCH;
+  }
+}
+
+/*********************/
+/* Shared task queue */
+/*********************/
+
+// Must hold pool_mutex. Goes in the queue for the task's priority. The caller
+// accounts for it in num_injected.
+static inline void _Threadpool_inject_locked(Threadpool *pool,
+                                             ThreadpoolNode *node,
+                                             TaskStack *work) {
+  // Note that the queue is initialized NULL.
+  // Doing it this way makes sure the pool's queue stays null terminated.
+  TaskStack **head = node->task_queue_head + work->priority;
+  TaskStack **tail = node->task_queue_tail + work->priority;
+  if (pool->order == THREADPOOL_FIFO) {
+    work->next = NULL;
+    if (*tail)
+      (*tail)->next = work;
+    else
+      *head = work;
+    *tail = work;
+  } else {
+    work->next = *head;
+    *head = work;
+    if (!*tail)
+      *tail = work;
+  }
+}
+
+// Must hold pool_mutex. Returns NULL if the queue is empty.
+static inline TaskStack *_Threadpool_uninject_locked(ThreadpoolNode *node,
+                                                     size_t prio) {
+  TaskStack *work = node->task_queue_head[prio];
+  if (work) {
+    node->task_queue_head[prio] = work->next;
+    if (!node->task_queue_head[prio])
+      node->task_queue_tail[prio] = NULL;
+    atomic_fetch_sub_explicit(&(node->num_injected[prio]), 1,
+                              memory_order_relaxed);
+  }
+  return work;
+}
+
+// The queue for tasks submitted by the calling thread. Workers use their own
+// node's. Other threads use the node they're running on, if any workers are
+// pinned there. Asking the kernel is a syscall, and threads rarely migrate
+// between nodes, so the answer is only refreshed every
+// THREADPOOL_NODE_RECHECK submits.
+static inline ThreadpoolNode *_Threadpool_submit_node(Threadpool *pool) {
+  ThreadpoolWorker *self = _Threadpool_current_worker;
+  if (self && self->pool == pool)
+    return pool->nodes + self->node;
+
+#ifdef __linux__
+  if (pool->num_nodes > 1) {
+    if (!_Threadpool_os_node_ttl) {
+      unsigned cpu, os_node;
+      _Threadpool_os_node =
+          syscall(SYS_getcpu, &cpu, &os_node, NULL) ? -1 : (int)os_node;
+      _Threadpool_os_node_ttl = THREADPOOL_NODE_RECHECK;
+    }
+    _Threadpool_os_node_ttl--;
+    for (size_t i = 0; i < pool->num_nodes; i++)
+      if (pool->nodes[i].os_node == _Threadpool_os_node)
+        return pool->nodes + i;
+  }
+#endif
+  return pool->nodes;
+}
+
+/************/
+/* Topology */
+/************/
+
+// The CPUs the machine has online and the NUMA node each is on, as far as
+// sysfs says. When it can't be read, there are no CPUs.
+struct _ThreadpoolTopology;
+typedef struct _ThreadpoolTopology _ThreadpoolTopology;
+struct _ThreadpoolTopology {
+  bool online[THREADPOOL_MAX_CPUS];
+  bool primary[THREADPOOL_MAX_CPUS]; // First hardware thread of its core.
+  int node_of[THREADPOOL_MAX_CPUS];
+  size_t num_cpus;
+};
+
+#ifdef __linux__
+// Reads a sysfs cpu list like "0-3,8-11" into a set of CPUs. Returns false if
+// the file can't be read.
+static inline bool _Threadpool_read_cpulist(const char *path, bool *set) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return false;
+  char buf[4096];
+  bool ok = fgets(buf, sizeof(buf), f) != NULL;
+  fclose(f);
+  if (!ok)
+    return false;
+
+  memset(set, 0, THREADPOOL_MAX_CPUS * sizeof(bool));
+  char *c = buf;
+  while (*c >= '0' && *c <= '9') {
+    long lo = strtol(c, &c, 10), hi = lo;
+    if (*c == '-')
+      hi = strtol(c + 1, &c, 10);
+    for (long i = lo; i <= hi && i < THREADPOOL_MAX_CPUS; i++)
+      set[i] = true;
+    if (*c == ',')
+      c++;
+  }
+  return true;
+}
+#endif
+
+static inline void _Threadpool_topology(_ThreadpoolTopology *topo) {
+  memset(topo, 0, sizeof(_ThreadpoolTopology));
+#ifdef __linux__
+  if (!_Threadpool_read_cpulist("/sys/devices/system/cpu/online",
+                                topo->online))
+    return;
+
+  // Machines without NUMA have no node directories. Everything is node 0.
+  bool set[THREADPOOL_MAX_CPUS];
+  char path[128];
+  for (int n = 0; n < THREADPOOL_MAX_NODES; n++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+    if (_Threadpool_read_cpulist(path, set))
+      for (size_t c = 0; c < THREADPOOL_MAX_CPUS; c++)
+        if (set[c])
+          topo->node_of[c] = n;
+  }
+
+  for (size_t c = 0; c < THREADPOOL_MAX_CPUS; c++) {
+    if (!topo->online[c])
+      continue;
+    topo->num_cpus++;
+
+    // Hyperthreads of the same core list each other as siblings. The lowest
+    // numbered one stands in for the core.
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%zu/topology/thread_siblings_list",
+             c);
+    topo->primary[c] = true;
+    if (_Threadpool_read_cpulist(path, set))
+      for (size_t d = 0; d < c; d++)
+        if (set[d] && topo->online[d])
+          topo->primary[c] = false;
+  }
+#endif
+}
+
+// The number of physical cores, or of online CPUs when the topology can't be
+// read. This is how many workers THREADPOOL_PIN_CORES starts by default.
+static inline size_t Threadpool_num_cores(void) {
+  _ThreadpoolTopology topo;
+  _Threadpool_topology(&topo);
+  size_t cores = 0;
+  for (size_t c = 0; c < THREADPOOL_MAX_CPUS; c++)
+    cores += topo.online[c] && topo.primary[c];
+  if (cores)
+    return cores;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? (size_t)cpus : 1;
+}
+
+// Pins the calling thread to the CPU. Does nothing when it can't.
+static inline void _Threadpool_pin_self(int cpu) {
+#ifdef __linux__
+  if (cpu < 0 || cpu >= THREADPOOL_MAX_CPUS)
+    return;
+  unsigned long mask[THREADPOOL_MAX_CPUS / (8 * sizeof(unsigned long))] = {0};
+  mask[cpu / (8 * sizeof(unsigned long))] |=
+      1ul << (cpu % (8 * sizeof(unsigned long)));
+  syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+#else
+  (void)cpu;
+#endif
+}
+
+/****************/
+/* Stats upkeep */
+/****************/
+
+// Always reads the clock. Elastic growth times the shared queue with it,
+// whether or not stats are compiled in.
+static inline uint64_t _Threadpool_monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// The clock for stats, which is always 0 without them.
+static inline uint64_t _Threadpool_now_ns(void) {
+#if THREADPOOL_STATS
+  return _Threadpool_monotonic_ns();
+#else
+  return 0;
+#endif
+}
+
+// Owner only.
+static inline void _Threadpool_count(_Atomic uint64_t *counter, uint64_t n) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
+
+static inline size_t _Threadpool_latency_bucket(uint64_t ns) {
+  size_t bucket = 0;
+  while ((ns >>= 1) && bucket < THREADPOOL_LATENCY_BUCKETS - 1)
+    bucket++;
+  return bucket;
+}
+
+// The enqueue time to stamp on the next n tasks the current thread submits if
+// one of them is to be sampled, and 0 otherwise.
+static inline uint64_t _Threadpool_stamp(size_t n) {
+#if THREADPOOL_STATS
+  size_t before = _Threadpool_submits;
+  _Threadpool_submits += n;
+  if (before / THREADPOOL_LATENCY_SAMPLE != _Threadpool_submits /
+                                                THREADPOOL_LATENCY_SAMPLE)
+    return _Threadpool_now_ns();
+#else
+  (void)n;
+#endif
+  return 0;
+}
+
+// Must hold pool_mutex. A thread is about to start in the worker's slot, and
+// starts out idle.
+static inline void _Threadpool_clock_start(ThreadpoolWorker *worker) {
+#if THREADPOOL_STATS
+  uint64_t now = _Threadpool_now_ns();
+  atomic_store_explicit(&(worker->counters.started_ns), now,
+                        memory_order_relaxed);
+  atomic_store_explicit(&(worker->counters.idle_since_ns), now,
+                        memory_order_relaxed);
+#else
+  (void)worker;
+#endif
+}
+
+// Owner only. The worker is retiring while idle. Fold the time it's been idle
+// and alive into its totals, and stop counting until the slot is used again.
+static inline void _Threadpool_clock_stop(ThreadpoolWorker *self) {
+#if THREADPOOL_STATS
+  uint64_t now = _Threadpool_now_ns();
+  uint64_t since = atomic_load_explicit(&(self->counters.idle_since_ns),
+                                        memory_order_relaxed);
+  if (since)
+    _Threadpool_count(&(self->counters.idle_ns), now - since);
+  atomic_store_explicit(&(self->counters.idle_since_ns), 0,
+                        memory_order_relaxed);
+  _Threadpool_count(&(self->counters.lived_ns),
+                    now - atomic_load_explicit(&(self->counters.started_ns),
+                                               memory_order_relaxed));
+  atomic_store_explicit(&(self->counters.started_ns), 0, memory_order_relaxed);
+#else
+  (void)self;
+#endif
+}
+
+// Owner only. The worker ran out of work.
+static inline void _Threadpool_idle_begin(ThreadpoolWorker *self) {
+#if THREADPOOL_STATS
+  atomic_store_explicit(&(self->counters.idle_since_ns), _Threadpool_now_ns(),
+                        memory_order_relaxed);
+#else
+  (void)self;
+#endif
+}
+
+// Owner only. The worker found work again.
+static inline void _Threadpool_idle_end(ThreadpoolWorker *self) {
+#if THREADPOOL_STATS
+  uint64_t since = atomic_load_explicit(&(self->counters.idle_since_ns),
+                                        memory_order_relaxed);
+  _Threadpool_count(&(self->counters.idle_ns), _Threadpool_now_ns() - since);
+  atomic_store_explicit(&(self->counters.idle_since_ns), 0,
+                        memory_order_relaxed);
+#else
+  (void)self;
+#endif
+}
+
 /**********************/
 /* Threadpool methods */
 /**********************/
 
-static void *await_and_do_tasks(void *pool_arg);
+static void *await_and_do_tasks(void *worker_arg);
+
+// The default options: LIFO order with a fixed num_threads unpinned workers.
+static inline ThreadpoolConfig Threadpool_config(size_t num_threads) {
+  ThreadpoolConfig config;
+  config.num_threads = num_threads;
+  config.order = THREADPOOL_LIFO;
+  config.pinning = THREADPOOL_PIN_NONE;
+  config.cpus = NULL;
+  config.num_cpus = 0;
+  config.min_threads = num_threads;
+  config.max_threads = num_threads;
+  config.grow_after_us = 0;
+  config.idle_timeout_ms = 0;
+  config.capacity = 0;
+  config.backpressure = THREADPOOL_BLOCK;
+  return config;
+}
+
+// Decides which CPU each worker is pinned to, and groups the workers into
+// nodes by the NUMA node of their CPU.
+static inline void _Threadpool_place(Threadpool *pool,
+                                     ThreadpoolConfig config) {
+  ThreadpoolNode *nodes = pool->nodes;
+  pool->num_nodes = 1;
+  nodes[0].os_node = -1;
+  for (size_t i = 0; i < pool->max_threads; i++) {
+    pool->workers[i].cpu = -1;
+    pool->workers[i].node = 0;
+  }
+  if (config.pinning == THREADPOOL_PIN_NONE ||
+      (config.pinning == THREADPOOL_PIN_CPUS && !config.num_cpus))
+    return;
+
+  _ThreadpoolTopology topo;
+  _Threadpool_topology(&topo);
+  if (!topo.num_cpus)
+    return;
+
+  if (config.pinning == THREADPOOL_PIN_CPUS) {
+    for (size_t i = 0; i < pool->max_threads; i++)
+      pool->workers[i].cpu = config.cpus[i % config.num_cpus];
+  } else {
+    // Deal out the physical cores in node order, wrapping around if there
+    // are more workers than cores.
+    size_t i = 0;
+    while (i < pool->max_threads) {
+      for (int n = 0; n < THREADPOOL_MAX_NODES; n++)
+        for (int c = 0; c < THREADPOOL_MAX_CPUS && i < pool->max_threads; c++)
+          if (topo.online[c] && topo.primary[c] && topo.node_of[c] == n)
+            pool->workers[i++].cpu = c;
+    }
+  }
+
+  pool->num_nodes = 0;
+  for (size_t i = 0; i < pool->max_threads; i++) {
+    int cpu = pool->workers[i].cpu;
+    int os_node =
+        cpu >= 0 && cpu < THREADPOOL_MAX_CPUS ? topo.node_of[cpu] : 0;
+    size_t n = 0;
+    while (n < pool->num_nodes && nodes[n].os_node != os_node)
+      n++;
+    if (n == pool->num_nodes)
+      nodes[pool->num_nodes++].os_node = os_node;
+    pool->workers[i].node = n;
+  }
+}
 
 // Create the pool before you add tasks to it. Then destroy it once you're done.
-static inline void Threadpool_create(Threadpool *pool, size_t num_threads) {
+static inline void Threadpool_create_with(Threadpool *pool,
+                                          ThreadpoolConfig config) {
+  if (config.pinning == THREADPOOL_PIN_CORES && !config.num_threads)
+    config.num_threads = Threadpool_num_cores();
+  size_t num_threads = config.num_threads;
+  size_t max_threads =
+      config.max_threads > num_threads ? config.max_threads : num_threads;
+  size_t min_threads =
+      config.min_threads < num_threads ? config.min_threads : num_threads;
+
   // Initialize the pool
   static mutex_t pmut_init = MUTEX_INITIALIZER;
+  static cond_t pcond_init = COND_INITIALIZER;
   pool->pool_mutex = pmut_init;
-  pool->task_stack = NULL;
-  pool->is_shutdown = false;
+  pool->work_cond = pcond_init;
+  pool->order = config.order;
+  pool->free_nodes = NULL;
+  pool->slabs = NULL;
+  atomic_init(&(pool->is_shutdown), false);
+  atomic_init(&(pool->drop_pending), false);
+
+  pool->max_threads = max_threads;
+  pool->min_threads = min_threads ? min_threads : 1;
+  atomic_init(&(pool->num_threads), num_threads);
+  atomic_init(&(pool->target_threads), num_threads);
+  pool->grow_after_ns = config.grow_after_us * 1000;
+  pool->idle_timeout_ms = config.idle_timeout_ms;
+  pool->capacity = config.capacity;
+  pool->backpressure = config.backpressure;
+  atomic_init(&(pool->num_queued), 0);
+  atomic_init(&(pool->num_blocked), 0);
+  pool->space_cond = pcond_init;
+  pool->blocked_cond = pcond_init;
+  atomic_init(&(pool->num_threads_sleeping), 0);
+  pool->wake_epoch = 0;
 
-  pool->num_threads = num_threads;
-  pool->num_threads_running = num_threads;
-  pool->threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  // Give each worker and node its own cache lines, so that their queues
+  // don't share. There's at most one node per worker.
+  size_t max_nodes = max_threads ? max_threads : 1;
+  pool->workers_alloc = malloc(max_threads * sizeof(ThreadpoolWorker) +
+                               max_nodes * sizeof(ThreadpoolNode) +
+                               THREADPOOL_CACHE_LINE);
+  pool->workers =
+      (ThreadpoolWorker *)(((uintptr_t)pool->workers_alloc +
+                            THREADPOOL_CACHE_LINE - 1) &
+                           ~(uintptr_t)(THREADPOOL_CACHE_LINE - 1));
+  pool->nodes = (ThreadpoolNode *)(pool->workers + max_threads);
+  for (size_t i = 0; i < max_nodes; i++) {
+    ThreadpoolNode *node = pool->nodes + i;
+    for (size_t p = 0; p < THREADPOOL_PRIORITIES; p++) {
+      node->task_queue_head[p] = NULL;
+      node->task_queue_tail[p] = NULL;
+      atomic_init(&(node->num_injected[p]), 0);
+    }
+    node->num_workers = 0;
+  }
+  for (size_t i = 0; i < max_threads; i++) {
+    ThreadpoolWorker *worker = pool->workers + i;
+    for (size_t p = 0; p < THREADPOOL_PRIORITIES; p++)
+      _TaskDeque_init(worker->deques + p);
+    worker->pool = pool;
+    worker->id = i;
+    worker->rng = (uint64_t)(i + 1) * 0x9E3779B97F4A7C15ull;
+    worker->priority = THREADPOOL_PRIO_NORMAL;
+    worker->picks = 0;
+    memset(&(worker->counters), 0, sizeof(_ThreadpoolCounters));
+    if (i < num_threads)
+      _Threadpool_clock_start(worker);
+    worker->free_nodes = NULL;
+    worker->num_free_nodes = 0;
+    Arena_init(&(worker->arena), (char *)"Threadpool worker", NULL, 0);
+    worker->state = i < num_threads ? _THREADPOOL_SLOT_RUNNING
+                                    : _THREADPOOL_SLOT_EMPTY;
+  }
+  _Threadpool_place(pool, config);
+  for (size_t i = 0; i < max_threads; i++)
+    pool->nodes[pool->workers[i].node].num_workers++;
 
-  // Spin threads. They wrap on the spinlock doing work until the pool is
-  // shut down. They detach themselves and do not need to be joined.
+  // Spin threads. They do work until the pool is shut down, sleeping on the
+  // pool's condition variable while there's nothing to do. Destroying the
+  // pool joins them.
   for (size_t i = 0; i < num_threads; i++) {
-    pthread_create(&(pool->threads[i]), NULL, await_and_do_tasks, pool);
+    ThreadpoolWorker *worker = pool->workers + i;
+    pthread_create(&(worker->thread), NULL, await_and_do_tasks, worker);
   }
 }
 
-// Do not exec tasks in the pool before it is created or after it is destroyed.
-// Do not exec a task that will not finish.
-// Returns true on success, false on failure. Fails when pool is already shut
+// Must hold pool_mutex. Starts a worker in an empty slot, if there is one.
+static inline void _Threadpool_spawn_locked(Threadpool *pool) {
+  for (size_t i = 0; i < pool->max_threads; i++) {
+    ThreadpoolWorker *worker = pool->workers + i;
+    if (worker->state == _THREADPOOL_SLOT_RUNNING)
+      continue;
+
+    // A retired worker let go of the lock for good before it exited, so it
+    // can be joined while we hold it.
+    if (worker->state == _THREADPOOL_SLOT_RETIRED)
+      pthread_join(worker->thread, NULL);
+    worker->state = _THREADPOOL_SLOT_RUNNING;
+    atomic_fetch_add_explicit(&(pool->num_threads), 1, memory_order_relaxed);
+    _Threadpool_clock_start(worker);
+    pthread_create(&(worker->thread), NULL, await_and_do_tasks, worker);
+    return;
+  }
+}
+
+// Must hold pool_mutex. Retires the worker, unless its deques still have
+// tasks in them that other workers might not know to look for, or the pool
+// is shutting down. Returns whether it did.
+static inline bool _Threadpool_retire_locked(ThreadpoolWorker *self) {
+  Threadpool *pool = self->pool;
+  if (atomic_load_explicit(&(pool->is_shutdown), memory_order_relaxed))
+    return false;
+  for (size_t p = 0; p < THREADPOOL_PRIORITIES; p++)
+    if (_TaskDeque_space(self->deques + p) != THREADPOOL_DEQUE_CAP)
+      return false;
+
+  while (self->free_nodes) {
+    TaskStack *give = self->free_nodes;
+    self->free_nodes = give->next;
+    _Threadpool_free_node_locked(pool, give);
+  }
+  self->num_free_nodes = 0;
+
+  _Threadpool_clock_stop(self);
+  self->state = _THREADPOOL_SLOT_RETIRED;
+  atomic_fetch_sub_explicit(&(pool->num_threads), 1, memory_order_relaxed);
+  return true;
+}
+
+// Retire if there are more workers than the pool wants.
+static inline bool _Threadpool_retire_extra(ThreadpoolWorker *self) {
+  Threadpool *pool = self->pool;
+  if (atomic_load_explicit(&(pool->num_threads), memory_order_relaxed) <=
+      atomic_load_explicit(&(pool->target_threads), memory_order_relaxed))
+    return false;
+
+  bool retired = false;
+  Threadpool_CRITICAL_BEGIN;
+  if (atomic_load_explicit(&(pool->num_threads), memory_order_relaxed) >
+      atomic_load_explicit(&(pool->target_threads), memory_order_relaxed))
+    retired = _Threadpool_retire_locked(self);
+  Threadpool_CRITICAL_END;
+  return retired;
+}
+
+// Must hold pool_mutex. Starts another worker if the oldest task in the queue
+// has waited too long and there's nobody asleep who could take it.
+static inline void _Threadpool_grow_locked(Threadpool *pool,
+                                           ThreadpoolNode *node,
+                                           ThreadpoolPriority priority) {
+  size_t target =
+      atomic_load_explicit(&(pool->target_threads), memory_order_relaxed);
+  if (!pool->grow_after_ns || target >= pool->max_threads ||
+      atomic_load_explicit(&(pool->num_threads_sleeping),
+                           memory_order_relaxed))
+    return;
+
+  TaskStack *oldest = pool->order == THREADPOOL_FIFO
+                          ? node->task_queue_head[priority]
+                          : node->task_queue_tail[priority];
+  if (!oldest || !oldest->enqueued_ns ||
+      _Threadpool_monotonic_ns() - oldest->enqueued_ns < pool->grow_after_ns)
+    return;
+
+  atomic_store_explicit(&(pool->target_threads), target + 1,
+                        memory_order_relaxed);
+  if (atomic_load_explicit(&(pool->num_threads), memory_order_relaxed) <
+      target + 1)
+    _Threadpool_spawn_locked(pool);
+}
+
+// Start or retire workers until there are n of them. n is kept between 1 and
+// the pool's max_threads. Workers finish the task they're running before
+// they retire. The pool keeps growing and shrinking on its own afterwards if
+// it was configured to. Returns the new size.
+static inline size_t Threadpool_resize(Threadpool *pool, size_t n) {
+  n = n < 1 ? 1 : n;
+  n = n > pool->max_threads ? pool->max_threads : n;
+
+  Threadpool_CRITICAL_BEGIN;
+  if (!atomic_load_explicit(&(pool->is_shutdown), memory_order_relaxed)) {
+    atomic_store_explicit(&(pool->target_threads), n, memory_order_relaxed);
+    while (atomic_load_explicit(&(pool->num_threads), memory_order_relaxed) < n)
+      _Threadpool_spawn_locked(pool);
+
+    // Wake everyone, so that sleepers notice they should retire.
+    if (atomic_load_explicit(&(pool->num_threads), memory_order_relaxed) > n) {
+      pool->wake_epoch++;
+      cond_broadcast(&(pool->work_cond));
+    }
+  }
+  Threadpool_CRITICAL_END;
+  return n;
+}
+
+// Shorthand for a LIFO pool with default options.
+static inline void Threadpool_create(Threadpool *pool, size_t num_threads) {
+  Threadpool_create_with(pool, Threadpool_config(num_threads));
+}
+
+// Must hold pool_mutex. Wakes up to n sleeping workers.
+static inline void _Threadpool_wake_locked(Threadpool *pool, size_t n) {
+  size_t sleeping = atomic_load_explicit(&(pool->num_threads_sleeping),
+                                         memory_order_relaxed);
+  if (n > sleeping)
+    n = sleeping;
+  if (!n)
+    return;
+
+  pool->wake_epoch++;
+  if (n == sleeping) {
+    cond_broadcast(&(pool->work_cond));
+  } else {
+    for (size_t i = 0; i < n; i++)
+      cond_signal(&(pool->work_cond));
+  }
+}
+
+// Wake up to n sleeping workers, if there are any. Callers must have
+// published their tasks before calling this.
+static inline void _Threadpool_wake(Threadpool *pool, size_t n) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!n || !atomic_load_explicit(&(pool->num_threads_sleeping),
+                                  memory_order_relaxed))
+    return;
+
+  Threadpool_CRITICAL_BEGIN;
+  _Threadpool_wake_locked(pool, n);
+  Threadpool_CRITICAL_END;
+}
+
+static inline ThreadpoolPriority
+_Threadpool_priority(Threadpool *pool, ThreadpoolPriority priority) {
+  if (priority != THREADPOOL_PRIO_INHERIT)
+    return priority;
+  ThreadpoolWorker *self = _Threadpool_current_worker;
+  return self && self->pool == pool ? self->priority : THREADPOOL_PRIO_NORMAL;
+}
+
+// Submits a task without regard to capacity. Fails when the pool is shut
 // down.
-static inline bool Threadpool_exectask(Threadpool *pool, void (*task_fn)(void *args),
-                         void *task_args) {
-  // Put the thread in the pool so that it can be consumed.
+static inline bool _Threadpool_submit(Threadpool *pool,
+                                      void (*task_fn)(void *args),
+                                      void *task_args,
+                                      ThreadpoolPriority priority,
+                                      WaitGroup *wait_group) {
+  // Fails if already shut down
+  if (atomic_load_explicit(&(pool->is_shutdown), memory_order_acquire))
+    return 0;
+
+  if (wait_group)
+    WaitGroup_add(wait_group, 1);
+  priority = _Threadpool_priority(pool, priority);
+
+  // Tasks submitted by one of our own workers go onto its own deque, where
+  // it will pick them up next unless somebody steals them first.
+  TaskStack *work = NULL;
+  ThreadpoolWorker *self = _Threadpool_current_worker;
+  if (self && self->pool == pool) {
+    work = _ThreadpoolWorker_node(self);
+    work->task_fn = task_fn;
+    work->task_args = task_args;
+    work->wait_group = wait_group;
+    work->priority = priority;
+    work->enqueued_ns = _Threadpool_stamp(1);
+    work->sampled = work->enqueued_ns != 0;
+    if (_TaskDeque_push(self->deques + priority, work)) {
+      _Threadpool_wake(pool, 1);
+      return 1;
+    }
+  }
+
+  // Everything else goes through the shared queue.
   Threadpool_CRITICAL_BEGIN;
   {
-    // Fails if already shut down
-    if (pool->is_shutdown) {
+    // Check again, now that destroy() can't be halfway through.
+    if (atomic_load_explicit(&(pool->is_shutdown), memory_order_relaxed)) {
+      if (work)
+        _Threadpool_free_node_locked(pool, work);
+      Threadpool_CRITICAL_END;
+      if (wait_group)
+        WaitGroup_done(wait_group);
       return 0;
     }
 
-    // Push work onto the TaskStack
-    TaskStack *work = (TaskStack *)malloc(sizeof(TaskStack));
-    work->task_fn = task_fn;
-    work->task_args = task_args;
+    if (!work) {
+      work = _Threadpool_node_locked(pool);
+      work->task_fn = task_fn;
+      work->task_args = task_args;
+      work->wait_group = wait_group;
+      work->priority = priority;
+      work->enqueued_ns = _Threadpool_stamp(1);
+      work->sampled = work->enqueued_ns != 0;
+    }
 
-    // Note that the TaskStack is initialized NULL.
-    // Doing it this way makes sure the pool's TaskStack stays null terminated.
-    work->next = pool->task_stack;
-    pool->task_stack = work;
+    // Elastic pools time everything that goes through the shared queue, to
+    // tell when it's backing up.
+    if (pool->grow_after_ns && !work->enqueued_ns)
+      work->enqueued_ns = _Threadpool_monotonic_ns();
+
+    ThreadpoolNode *node = _Threadpool_submit_node(pool);
+    _Threadpool_inject_locked(pool, node, work);
+    atomic_fetch_add_explicit(&(node->num_injected[priority]), 1,
+                              memory_order_relaxed);
+    _Threadpool_grow_locked(pool, node, priority);
+
+    // Wake a sleeping worker to take it.
+    _Threadpool_wake_locked(pool, 1);
   }
   Threadpool_CRITICAL_END;
 
   return 1;
 }
 
-static inline void *await_and_do_tasks(void *pool_arg) {
-  Threadpool *pool = (Threadpool *)pool_arg;
-
-  // Detach self
-  pthread_detach(pthread_self());
+/****************/
+/* Backpressure */
+/****************/
 
-  // Spinlock waiting for work
+// Reserves room in a bounded pool for n more tasks, or as many of them as
+// fit if partial. Returns how many it reserved.
+static inline size_t _Threadpool_reserve(Threadpool *pool, size_t n,
+                                         bool partial) {
+  size_t queued =
+      atomic_load_explicit(&(pool->num_queued), memory_order_relaxed);
   while (true) {
-    // Try to obtain work
-    TaskStack *work = NULL;
+    size_t room = queued < pool->capacity ? pool->capacity - queued : 0;
+    size_t take = n < room ? n : room;
+    if (!take || (!partial && take < n))
+      return 0;
+    if (atomic_compare_exchange_weak_explicit(&(pool->num_queued), &queued,
+                                              queued + take,
+                                              memory_order_seq_cst,
+                                              memory_order_relaxed))
+      return take;
+  }
+}
 
-    /* Critical section */
+// Gives back room, as tasks start or fail to be submitted.
+static inline void _Threadpool_release(Threadpool *pool, size_t n) {
+  atomic_fetch_sub_explicit(&(pool->num_queued), n, memory_order_seq_cst);
+  if (atomic_load_explicit(&(pool->num_blocked), memory_order_seq_cst)) {
     Threadpool_CRITICAL_BEGIN;
-    {
-      // Join self when the pool shuts down,
-      // making sure to end the critical section.
-      if (pool->is_shutdown && pool->task_stack == NULL) {
-        pool->num_threads_running--;
-        Threadpool_CRITICAL_END;
-        return NULL;
-      }
+    cond_broadcast(&(pool->space_cond));
+    Threadpool_CRITICAL_END;
+  }
+}
+
+// Blocks until there's room, then reserves like _Threadpool_reserve().
+// Returns 0 if the pool shuts down first.
+static inline size_t _Threadpool_await_room(Threadpool *pool, size_t n,
+                                            bool partial) {
+  size_t got;
+  Threadpool_CRITICAL_BEGIN;
+  atomic_fetch_add_explicit(&(pool->num_blocked), 1, memory_order_seq_cst);
+  while (!(got = _Threadpool_reserve(pool, n, partial)) &&
+         !atomic_load_explicit(&(pool->is_shutdown), memory_order_relaxed))
+    cond_wait(&(pool->space_cond), &(pool->pool_mutex));
+  if (atomic_fetch_sub_explicit(&(pool->num_blocked), 1,
+                                memory_order_relaxed) == 1 &&
+      atomic_load_explicit(&(pool->is_shutdown), memory_order_relaxed))
+    cond_broadcast(&(pool->blocked_cond));
+  Threadpool_CRITICAL_END;
+  return got;
+}
+
+// Whether a full pool should run the task on the calling thread.
+static inline bool _Threadpool_runs_inline(Threadpool *pool,
+                                           ThreadpoolBackpressure policy) {
+  ThreadpoolWorker *self = _Threadpool_current_worker;
+  return policy == THREADPOOL_CALLER_RUNS ||
+         (policy == THREADPOOL_BLOCK && self && self->pool == pool);
+}
 
-      // Check for work. If we find some, pop it from the
-      // stack and let the threadpool know that we're working on something.
+static inline bool _Threadpool_exectask_with(Threadpool *pool,
+                                             void (*task_fn)(void *args),
+                                             void *task_args,
+                                             ThreadpoolPriority priority,
+                                             WaitGroup *wait_group,
+                                             ThreadpoolBackpressure policy) {
+  if (!pool->capacity)
+    return _Threadpool_submit(pool, task_fn, task_args, priority, wait_group);
+  if (atomic_load_explicit(&(pool->is_shutdown), memory_order_acquire))
+    return 0;
 
-      work = pool->task_stack;
-      if (work) {
-        pool->task_stack = work->next;
+  if (!_Threadpool_reserve(pool, 1, false)) {
+    if (_Threadpool_runs_inline(pool, policy)) {
+      task_fn(task_args);
+      return 1;
+    }
+    if (policy == THREADPOOL_FAIL || !_Threadpool_await_room(pool, 1, false))
+      return 0;
+  }
+
+  if (!_Threadpool_submit(pool, task_fn, task_args, priority, wait_group)) {
+    _Threadpool_release(pool, 1);
+    return 0;
+  }
+  return 1;
+}
+
+// Do not exec tasks in the pool before it is created or after it is destroyed.
+// Do not exec a task that will not finish.
+// Returns true on success, false on failure. Fails when pool is already shut
+// down. When the pool has a capacity and is full, what happens depends on
+// its backpressure policy. Tasks run by the caller count as a success.
+//
+// If wait_group is not NULL, it's counted up before the task is submitted and
+// counted down once the task has run. See Threadpool_await().
+static inline bool Threadpool_exectask_prio_group(Threadpool *pool,
+                                                  void (*task_fn)(void *args),
+                                                  void *task_args,
+                                                  ThreadpoolPriority priority,
+                                                  WaitGroup *wait_group) {
+  return _Threadpool_exectask_with(pool, task_fn, task_args, priority,
+                                   wait_group, pool->backpressure);
+}
+
+static inline bool Threadpool_exectask_group(Threadpool *pool,
+                                             void (*task_fn)(void *args),
+                                             void *task_args,
+                                             WaitGroup *wait_group) {
+  return Threadpool_exectask_prio_group(pool, task_fn, task_args,
+                                        THREADPOOL_PRIO_INHERIT, wait_group);
+}
+
+static inline bool Threadpool_exectask_prio(Threadpool *pool,
+                                            void (*task_fn)(void *args),
+                                            void *task_args,
+                                            ThreadpoolPriority priority) {
+  return Threadpool_exectask_prio_group(pool, task_fn, task_args, priority,
+                                        NULL);
+}
+
+static inline bool Threadpool_exectask(Threadpool *pool,
+                                       void (*task_fn)(void *args),
+                                       void *task_args) {
+  return Threadpool_exectask_prio_group(pool, task_fn, task_args,
+                                        THREADPOOL_PRIO_INHERIT, NULL);
+}
+
+// Like Threadpool_exectask(), but never waits or runs the task itself. Fails
+// when the pool is full, whatever its backpressure policy.
+static inline bool Threadpool_try_exectask(Threadpool *pool,
+                                           void (*task_fn)(void *args),
+                                           void *task_args) {
+  return _Threadpool_exectask_with(pool, task_fn, task_args,
+                                   THREADPOOL_PRIO_INHERIT, NULL,
+                                   THREADPOOL_FAIL);
+}
+
+// Submits a batch without regard to capacity. Fails when the pool is shut
+// down, in which case none of the tasks were submitted.
+static inline bool _Threadpool_submit_batch(Threadpool *pool,
+                                            void (*task_fn)(void *args),
+                                            void **task_args, size_t n,
+                                            ThreadpoolPriority priority,
+                                            WaitGroup *wait_group) {
+  // Fails if already shut down
+  if (atomic_load_explicit(&(pool->is_shutdown), memory_order_acquire))
+    return 0;
+
+  if (wait_group)
+    WaitGroup_add(wait_group, n);
+  priority = _Threadpool_priority(pool, priority);
+
+  uint64_t now_ns = _Threadpool_stamp(n);
+  bool sampled = now_ns != 0;
+
+  // From inside the pool, fill our own deque first.
+  size_t i = 0;
+  ThreadpoolWorker *self = _Threadpool_current_worker;
+  if (self && self->pool == pool) {
+    for (; i < n; i++) {
+      TaskStack *work = _ThreadpoolWorker_node(self);
+      work->task_fn = task_fn;
+      work->task_args = task_args[i];
+      work->wait_group = wait_group;
+      work->priority = priority;
+      work->sampled = sampled && !(i % THREADPOOL_LATENCY_SAMPLE);
+      work->enqueued_ns = work->sampled ? now_ns : 0;
+      if (!_TaskDeque_push(self->deques + priority, work)) {
+        _ThreadpoolWorker_free_node(self, work);
+        break;
       }
     }
-    Threadpool_CRITICAL_END;
+    _Threadpool_wake(pool, i);
+  }
+  if (i == n)
+    return 1;
 
-    if (work) {
-      // Extract the work and args
-      void (*task_fn)(void *) = work->task_fn;
-      void *task_args = work->task_args;
-      free(work);
+  // Everything else goes through the shared queue.
+  ThreadpoolNode *node = _Threadpool_submit_node(pool);
+  Threadpool_CRITICAL_BEGIN;
+  {
+    // Check again, now that destroy() can't be halfway through. Once some of
+    // the batch is on our own deque, finish the job. We won't exit while our
+    // own tasks are still in the shared queue.
+    if (!i &&
+        atomic_load_explicit(&(pool->is_shutdown), memory_order_relaxed)) {
+      Threadpool_CRITICAL_END;
+      if (wait_group)
+        _WaitGroup_sub(wait_group, n);
+      return 0;
+    }
 
-      task_fn(task_args);
-    } else {
-      sched_yield();
+    size_t injected = n - i;
+    if (pool->grow_after_ns && !now_ns)
+      now_ns = _Threadpool_monotonic_ns();
+    for (; i < n; i++) {
+      TaskStack *work = _Threadpool_node_locked(pool);
+      work->task_fn = task_fn;
+      work->task_args = task_args[i];
+      work->wait_group = wait_group;
+      work->priority = priority;
+      work->sampled = sampled && !(i % THREADPOOL_LATENCY_SAMPLE);
+      work->enqueued_ns = work->sampled || pool->grow_after_ns ? now_ns : 0;
+      _Threadpool_inject_locked(pool, node, work);
+    }
+    atomic_fetch_add_explicit(&(node->num_injected[priority]), injected,
+                              memory_order_relaxed);
+    _Threadpool_grow_locked(pool, node, priority);
+
+    _Threadpool_wake_locked(pool, injected);
+  }
+  Threadpool_CRITICAL_END;
+
+  return 1;
+}
+
+// Submits n tasks at once, calling task_fn on each of task_args[0] through
+// task_args[n - 1]. This is much cheaper per task than calling
+// Threadpool_exectask() n times. The shared queue is locked once for the
+// whole batch, and only as many sleeping workers are woken as there are tasks.
+// Returns true on success, false on failure. Fails when pool is already shut
+// down, in which case none of the tasks were submitted.
+//
+// A full pool fails the whole batch under THREADPOOL_FAIL. Otherwise the
+// batch goes in as room frees up, with the caller running the tasks that
+// don't fit under THREADPOOL_CALLER_RUNS. If the pool shuts down while
+// THREADPOOL_BLOCK is waiting, the rest of the batch isn't submitted.
+//
+// If wait_group is not NULL, it's counted up before the tasks are submitted
+// and counted down as each one finishes.
+static inline bool Threadpool_exectask_batch_prio_group(
+    Threadpool *pool, void (*task_fn)(void *args), void **task_args, size_t n,
+    ThreadpoolPriority priority, WaitGroup *wait_group) {
+  if (!pool->capacity)
+    return _Threadpool_submit_batch(pool, task_fn, task_args, n, priority,
+                                    wait_group);
+  if (atomic_load_explicit(&(pool->is_shutdown), memory_order_acquire))
+    return 0;
+
+  if (pool->backpressure == THREADPOOL_FAIL) {
+    if (!_Threadpool_reserve(pool, n, false))
+      return 0;
+    if (!_Threadpool_submit_batch(pool, task_fn, task_args, n, priority,
+                                  wait_group)) {
+      _Threadpool_release(pool, n);
+      return 0;
+    }
+    return 1;
+  }
+
+  bool runs_inline = _Threadpool_runs_inline(pool, pool->backpressure);
+  for (size_t done = 0; done < n;) {
+    size_t got = _Threadpool_reserve(pool, n - done, true);
+    if (!got && runs_inline) {
+      task_fn(task_args[done++]);
       continue;
     }
+    if (!got && !(got = _Threadpool_await_room(pool, n - done, true)))
+      return 0;
+
+    if (!_Threadpool_submit_batch(pool, task_fn, task_args + done, got,
+                                  priority, wait_group)) {
+      _Threadpool_release(pool, got);
+      return 0;
+    }
+    done += got;
   }
+  return 1;
 }
 
-// Only destroy once, and not before the threadpool is created.
-static inline void Threadpool_destroy(Threadpool *pool) {
+static inline bool Threadpool_exectask_batch_group(Threadpool *pool,
+                                                   void (*task_fn)(void *args),
+                                                   void **task_args, size_t n,
+                                                   WaitGroup *wait_group) {
+  return Threadpool_exectask_batch_prio_group(
+      pool, task_fn, task_args, n, THREADPOOL_PRIO_INHERIT, wait_group);
+}
+
+static inline bool Threadpool_exectask_batch(Threadpool *pool,
+                                             void (*task_fn)(void *args),
+                                             void **task_args, size_t n) {
+  return Threadpool_exectask_batch_group(pool, task_fn, task_args, n, NULL);
+}
+
+// Take a task from one of the shared queues, along with our share of the rest.
+static inline TaskStack *_Threadpool_take_injected(ThreadpoolWorker *self,
+                                                   ThreadpoolNode *node,
+                                                   size_t prio) {
+  if (!atomic_load_explicit(&(node->num_injected[prio]), memory_order_relaxed))
+    return NULL;
+
+  Threadpool *pool = self->pool;
   Threadpool_CRITICAL_BEGIN;
-  pool->is_shutdown = true;
+  TaskStack *work = _Threadpool_uninject_locked(node, prio);
+  if (work) {
+    // Take our share of the rest while we hold the lock, so that a big
+    // batch doesn't cost every worker a trip through the lock per task.
+    size_t share = atomic_load_explicit(&(node->num_injected[prio]),
+                                        memory_order_relaxed) /
+                   (node->num_workers ? node->num_workers : pool->max_threads);
+    size_t space = _TaskDeque_space(self->deques + prio);
+    share = share < space ? share : space;
+    share = share < THREADPOOL_NODE_BATCH ? share : THREADPOOL_NODE_BATCH;
+    for (size_t i = 0; i < share; i++)
+      _TaskDeque_push(self->deques + prio,
+                      _Threadpool_uninject_locked(node, prio));
+  }
   Threadpool_CRITICAL_END;
+  return work;
+}
 
-  // Wait for the task stack to be consumed.
-  bool waiting = true;
-  while (waiting) {
-    sched_yield();
+// Owner only.
+static inline TaskStack *_Threadpool_take_own(ThreadpoolWorker *self,
+                                              size_t prio) {
+  // Peek first, since taking from an empty deque isn't free.
+  TaskDeque *deque = self->deques + prio;
+  if (_TaskDeque_space(deque) == THREADPOOL_DEQUE_CAP)
+    return NULL;
 
-    Threadpool_CRITICAL_BEGIN;
-    waiting = pool->task_stack;
-    Threadpool_CRITICAL_END;
+  // Our own deque is a stack for its owner in LIFO mode, and a queue in FIFO
+  // mode. Thieves always take the oldest task.
+  return self->pool->order == THREADPOOL_FIFO ? _TaskDeque_steal(deque)
+                                              : _TaskDeque_take(deque);
+}
+
+// Look for work in the worker's own deques, then its node's shared queues,
+// then the deques of the other workers on its node. Only then try the other
+// nodes, their queues first. Each of these goes through the priorities in
+// the order given. Returns NULL if there's none to be found.
+static inline TaskStack *_Threadpool_search(ThreadpoolWorker *self,
+                                            size_t *prios) {
+  Threadpool *pool = self->pool;
+  TaskStack *work;
+  for (size_t p = 0; p < THREADPOOL_PRIORITIES; p++) {
+    if ((work = _Threadpool_take_own(self, prios[p])))
+      return work;
+    if ((work = _Threadpool_take_injected(self, pool->nodes + self->node,
+                                          prios[p])))
+      return work;
+  }
+
+  // Steal, starting from a random victim so thieves spread out. Retired
+  // workers' slots are empty, so there's no harm looking in them.
+  size_t n = pool->max_threads;
+  self->rng ^= self->rng << 13;
+  self->rng ^= self->rng >> 7;
+  self->rng ^= self->rng << 17;
+  size_t start = (size_t)(self->rng % n);
+  for (size_t p = 0; p < THREADPOOL_PRIORITIES; p++) {
+    for (size_t i = 0; i < n; i++) {
+      ThreadpoolWorker *victim = pool->workers + ((start + i) % n);
+      if (victim == self || victim->node != self->node)
+        continue;
+      if ((work = _TaskDeque_steal(victim->deques + prios[p]))) {
+#if THREADPOOL_STATS
+        _Threadpool_count(&(self->counters.steals), 1);
+#endif
+        return work;
+      }
+    }
+  }
+
+  if (pool->num_nodes == 1)
+    return NULL;
+
+  for (size_t p = 0; p < THREADPOOL_PRIORITIES; p++) {
+    for (size_t i = 1; i < pool->num_nodes; i++) {
+      ThreadpoolNode *node = pool->nodes + (self->node + i) % pool->num_nodes;
+      if ((work = _Threadpool_take_injected(self, node, prios[p])))
+        return work;
+    }
+    for (size_t i = 0; i < n; i++) {
+      ThreadpoolWorker *victim = pool->workers + ((start + i) % n);
+      if (victim->node == self->node)
+        continue;
+      if ((work = _TaskDeque_steal(victim->deques + prios[p]))) {
+#if THREADPOOL_STATS
+        _Threadpool_count(&(self->counters.steals), 1);
+#endif
+        return work;
+      }
+    }
   }
 
-  // Wait for the tasks to finish running
-  waiting = true;
-  while (waiting) {
+  return NULL;
+}
+
+// Searches from the highest priority to the lowest, except that every so
+// often one of the lower priorities goes first so that it can't starve.
+static inline TaskStack *_Threadpool_find_work(ThreadpoolWorker *self) {
+  size_t first = 0;
+  if (self->picks % THREADPOOL_AGING_PERIOD == THREADPOOL_AGING_PERIOD - 1)
+    first = 1 + (self->picks / THREADPOOL_AGING_PERIOD) %
+                    (THREADPOOL_PRIORITIES - 1);
+
+  size_t prios[THREADPOOL_PRIORITIES];
+  for (size_t i = 0; i < THREADPOOL_PRIORITIES; i++)
+    prios[i] = (first + i) % THREADPOOL_PRIORITIES;
+
+  TaskStack *work = _Threadpool_search(self, prios);
+  if (work)
+    self->picks++;
+  return work;
+}
+
+static inline void _Threadpool_run(ThreadpoolWorker *self, TaskStack *work) {
+  // Extract the work and args
+  void (*task_fn)(void *) = work->task_fn;
+  void *task_args = work->task_args;
+  WaitGroup *wait_group = work->wait_group;
+  ThreadpoolPriority outer = self->priority;
+  self->priority = work->priority;
+  if (self->pool->capacity)
+    _Threadpool_release(self->pool, 1);
+#if THREADPOOL_STATS
+  _Threadpool_count(&(self->counters.tasks_run), 1);
+  if (work->sampled) {
+    uint64_t waited_ns = _Threadpool_now_ns() - work->enqueued_ns;
+    _Threadpool_count(
+        self->counters.latency_ns + _Threadpool_latency_bucket(waited_ns), 1);
+  }
+#endif
+  _ThreadpoolWorker_free_node(self, work);
+
+  // When the pool is being torn down with destroy_now(), drain the pool by
+  // dropping tasks instead of running them. Their wait groups are still
+  // counted down, so nobody waits on them forever.
+  ArenaMark scratch = Arena_mark(&(self->arena));
+  if (!atomic_load_explicit(&(self->pool->drop_pending), memory_order_relaxed))
+    task_fn(task_args);
+  self->priority = outer;
+
+  // Whatever the task left on the arena is garbage now. A task that ran while
+  // another waits only frees its own, the other may still be using its part.
+  Arena_rewind(&(self->arena), scratch);
+
+  if (wait_group)
+    WaitGroup_done(wait_group);
+}
+
+static inline void *await_and_do_tasks(void *worker_arg) {
+  ThreadpoolWorker *self = (ThreadpoolWorker *)worker_arg;
+  Threadpool *pool = self->pool;
+  _Threadpool_current_worker = self;
+  _Threadpool_pin_self(self->cpu);
+
+  // Spin briefly waiting for work, then sleep until there's more.
+  size_t spin_limit = THREADPOOL_SPIN_ITERS;
+  size_t spins = 0;
+  bool idle = true;
+  while (true) {
+    // Read the shutdown flag first. Once it's set nothing new can be
+    // submitted, so if we then come up empty the pool is drained.
+    bool shutdown =
+        atomic_load_explicit(&(pool->is_shutdown), memory_order_acquire);
+
+    // Try to obtain work
+    TaskStack *work = _Threadpool_find_work(self);
+
+    if (work) {
+      // Found work while spinning, so spinning is worth more of our time.
+      if (spins)
+        spin_limit = spin_limit >= THREADPOOL_SPIN_ITERS / 2
+                         ? THREADPOOL_SPIN_ITERS
+                         : spin_limit * 2 + 1;
+      spins = 0;
+
+      if (idle)
+        _Threadpool_idle_end(self);
+      idle = false;
+      _Threadpool_run(self, work);
+      continue;
+    }
+
+    // Exit when the pool shuts down, to be joined by destroy().
+    if (shutdown)
+      break;
+
+    if (!idle)
+      _Threadpool_idle_begin(self);
+    idle = true;
+
+    // Leave if the pool has been shrunk.
+    if (_Threadpool_retire_extra(self))
+      break;
+
+    if (spins < spin_limit) {
+      spins++;
+      sched_yield();
+      continue;
+    }
+
+    // Spun long enough. Announce that we're going to sleep and look one last
+    // time, so that anybody publishing work concurrently either sees us
+    // sleeping and wakes us, or we see their work.
+    atomic_fetch_add_explicit(&(pool->num_threads_sleeping), 1,
+                              memory_order_seq_cst);
+    atomic_thread_fence(memory_order_seq_cst);
     Threadpool_CRITICAL_BEGIN;
-    waiting = pool->num_threads_running;
+    size_t epoch = pool->wake_epoch;
     Threadpool_CRITICAL_END;
 
-    sched_yield();
+    work = _Threadpool_find_work(self);
+    bool retired = false;
+    if (!work) {
+      // Park until exectask() or destroy() wakes us. Elastic pools retire
+      // workers that sleep through a whole idle timeout.
+      Threadpool_CRITICAL_BEGIN;
+      while (pool->wake_epoch == epoch &&
+             !atomic_load_explicit(&(pool->is_shutdown),
+                                   memory_order_relaxed)) {
+        size_t num = atomic_load_explicit(&(pool->num_threads),
+                                          memory_order_relaxed);
+        if (!pool->idle_timeout_ms || num <= pool->min_threads) {
+          cond_wait(&(pool->work_cond), &(pool->pool_mutex));
+          continue;
+        }
+
+        if (!cond_timedwait(&(pool->work_cond), &(pool->pool_mutex),
+                            (unsigned long)pool->idle_timeout_ms) ||
+            pool->wake_epoch != epoch)
+          continue;
+
+        // Others may have retired while we slept.
+        num = atomic_load_explicit(&(pool->num_threads), memory_order_relaxed);
+        if (num > pool->min_threads) {
+          size_t target = atomic_load_explicit(&(pool->target_threads),
+                                               memory_order_relaxed);
+          if (target > num - 1)
+            atomic_store_explicit(&(pool->target_threads), num - 1,
+                                  memory_order_relaxed);
+          if ((retired = _Threadpool_retire_locked(self)))
+            break;
+        }
+      }
+      Threadpool_CRITICAL_END;
+    }
+    atomic_fetch_sub_explicit(&(pool->num_threads_sleeping), 1,
+                              memory_order_relaxed);
+    if (retired)
+      break;
+
+    // Spin less next time since it didn't pay off. Keep spinning at least
+    // once, or finding work while spinning could never grow the limit back.
+    spin_limit = spin_limit > 1 ? spin_limit / 2 : 1;
+    spins = 0;
+
+    if (work) {
+      _Threadpool_idle_end(self);
+      idle = false;
+      _Threadpool_run(self, work);
+    }
+  }
+
+  return NULL;
+}
+
+/*****************/
+/* Worker arenas */
+/*****************/
+
+// The arena of the worker running the current task, or NULL when not called
+// from a task. Allocating on it is just a pointer bump, and everything the
+// task allocates on it is freed when the task returns, so don't keep pointers
+// into it past that. Use Arena_mark() and Arena_rewind() to free some of it
+// sooner, not Arena_reset(), which could pull it out from under a task that's
+// waiting on this one.
+static inline Arena *Threadpool_worker_arena(void) {
+  ThreadpoolWorker *self = _Threadpool_current_worker;
+  return self ? &(self->arena) : NULL;
+}
+
+/**************/
+/* Statistics */
+/**************/
+
+// Read one worker's counters.
+static inline ThreadpoolWorkerStats Threadpool_worker_stats(Threadpool *pool,
+                                                            size_t worker) {
+  _ThreadpoolCounters *c = &(pool->workers[worker].counters);
+  ThreadpoolWorkerStats stats;
+  stats.tasks_run = atomic_load_explicit(&(c->tasks_run), memory_order_relaxed);
+
+  // Busy time is whatever isn't idle, so it's only ever read, not counted.
+  // Slots without a thread have both clocks stopped.
+  uint64_t now = _Threadpool_now_ns();
+  uint64_t since =
+      atomic_load_explicit(&(c->idle_since_ns), memory_order_relaxed);
+  stats.idle_ns = atomic_load_explicit(&(c->idle_ns), memory_order_relaxed);
+  if (since && since < now)
+    stats.idle_ns += now - since;
+  uint64_t started =
+      atomic_load_explicit(&(c->started_ns), memory_order_relaxed);
+  uint64_t elapsed = atomic_load_explicit(&(c->lived_ns), memory_order_relaxed);
+  if (started && started < now)
+    elapsed += now - started;
+  stats.busy_ns = elapsed > stats.idle_ns ? elapsed - stats.idle_ns : 0;
+  stats.steals = atomic_load_explicit(&(c->steals), memory_order_relaxed);
+  for (size_t i = 0; i < THREADPOOL_LATENCY_BUCKETS; i++)
+    stats.latency_ns[i] =
+        atomic_load_explicit(c->latency_ns + i, memory_order_relaxed);
+  return stats;
+}
+
+// Take a snapshot of the whole pool. It's assembled while the workers keep
+// running, so the numbers are only roughly consistent with each other. All
+// zeros if the pool was compiled with THREADPOOL_STATS 0, except for the
+// thread and queue counts.
+static inline ThreadpoolStats Threadpool_stats(Threadpool *pool) {
+  ThreadpoolStats stats;
+  memset(&stats, 0, sizeof(ThreadpoolStats));
+  stats.num_threads =
+      atomic_load_explicit(&(pool->num_threads), memory_order_relaxed);
+  stats.num_sleeping = atomic_load_explicit(&(pool->num_threads_sleeping),
+                                            memory_order_relaxed);
+
+  for (size_t n = 0; n < pool->num_nodes; n++)
+    for (size_t p = 0; p < THREADPOOL_PRIORITIES; p++)
+      stats.queued += atomic_load_explicit(pool->nodes[n].num_injected + p,
+                                           memory_order_relaxed);
+
+  for (size_t i = 0; i < pool->max_threads; i++) {
+    for (size_t p = 0; p < THREADPOOL_PRIORITIES; p++) {
+      TaskDeque *deque = pool->workers[i].deques + p;
+      ptrdiff_t t = atomic_load_explicit(&(deque->top), memory_order_relaxed);
+      ptrdiff_t b =
+          atomic_load_explicit(&(deque->bottom), memory_order_relaxed);
+      if (b > t)
+        stats.queued += (size_t)(b - t);
+    }
+
+    ThreadpoolWorkerStats w = Threadpool_worker_stats(pool, i);
+    stats.totals.tasks_run += w.tasks_run;
+    stats.totals.busy_ns += w.busy_ns;
+    stats.totals.idle_ns += w.idle_ns;
+    stats.totals.steals += w.steals;
+    for (size_t j = 0; j < THREADPOOL_LATENCY_BUCKETS; j++)
+      stats.totals.latency_ns[j] += w.latency_ns[j];
+  }
+  return stats;
+}
+
+// An upper bound on the given fraction (0.99 for p99) of enqueue-to-start
+// latencies in the histogram, in nanoseconds. 0 if nothing has run.
+static inline uint64_t
+ThreadpoolStats_latency_percentile(ThreadpoolWorkerStats *stats,
+                                   double fraction) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < THREADPOOL_LATENCY_BUCKETS; i++)
+    total += stats->latency_ns[i];
+  if (!total)
+    return 0;
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < THREADPOOL_LATENCY_BUCKETS; i++) {
+    seen += stats->latency_ns[i];
+    if (seen >= fraction * total)
+      return (uint64_t)1 << (i + 1);
+  }
+  return UINT64_MAX;
+}
+
+/***************************/
+/* Waiting on tasks to end */
+/***************************/
+
+// Block until the wait group's tasks are done. Called from one of the pool's
+// own workers, this runs other tasks while it waits instead of tying up the
+// worker, so tasks can safely wait on the subtasks they submit.
+static inline void Threadpool_await(Threadpool *pool, WaitGroup *wg) {
+  ThreadpoolWorker *self = _Threadpool_current_worker;
+  if (self && self->pool == pool) {
+    while (atomic_load_explicit(&(wg->count), memory_order_acquire)) {
+      TaskStack *work = _Threadpool_find_work(self);
+      if (!work)
+        break;
+      _Threadpool_run(self, work);
+    }
+  }
+
+  // Nothing left to help with. Whatever's left is already running.
+  WaitGroup_wait(wg);
+}
+
+// The completion handle for a single task. Await each future exactly once.
+struct ThreadpoolFuture;
+typedef struct ThreadpoolFuture ThreadpoolFuture;
+struct ThreadpoolFuture {
+  WaitGroup wait_group;
+  Threadpool *pool;
+};
+
+// Like Threadpool_exectask(), but initializes future to track the task.
+// Returns false without initializing future if the pool is shut down.
+static inline bool Threadpool_exectask_future(Threadpool *pool,
+                                              void (*task_fn)(void *args),
+                                              void *task_args,
+                                              ThreadpoolFuture *future) {
+  WaitGroup_init(&(future->wait_group));
+  future->pool = pool;
+  if (!Threadpool_exectask_group(pool, task_fn, task_args,
+                                 &(future->wait_group))) {
+    WaitGroup_destroy(&(future->wait_group));
+    return 0;
+  }
+  return 1;
+}
+
+static inline bool ThreadpoolFuture_is_done(ThreadpoolFuture *future) {
+  return WaitGroup_is_done(&(future->wait_group));
+}
+
+// Block until the task has run, then release the future.
+static inline void ThreadpoolFuture_await(ThreadpoolFuture *future) {
+  Threadpool_await(future->pool, &(future->wait_group));
+  WaitGroup_destroy(&(future->wait_group));
+}
+
+/***************************/
+/* Parallel for and reduce */
+/***************************/
+
+// When no grain size is given, ranges are split into about this many chunks
+// per participating thread, so that threads which finish early can pick up
+// the slack from the rest.
+#ifndef THREADPOOL_CHUNKS_PER_THREAD
+#define THREADPOOL_CHUNKS_PER_THREAD 8
+#endif
+
+// Threadpool_parallel_reduce() keeps accumulators up to this many bytes in
+// total on the stack, and mallocs them past that.
+#ifndef THREADPOOL_REDUCE_STACK
+#define THREADPOOL_REDUCE_STACK 1024
+#endif
+
+// At most this many workers help with any one range, on top of the calling
+// thread. Their bookkeeping lives on the caller's stack.
+#ifndef THREADPOOL_RANGE_HELPERS
+#define THREADPOOL_RANGE_HELPERS 64
+#endif
+
+struct _ThreadpoolRange;
+typedef struct _ThreadpoolRange _ThreadpoolRange;
+struct _ThreadpoolRange {
+  _Atomic size_t next;
+  size_t end;
+  size_t grain;
+  void (*for_fn)(size_t begin, size_t end, void *ctx);
+  void (*reduce_fn)(size_t begin, size_t end, void *ctx, void *acc);
+  void *ctx;
+};
+
+struct _ThreadpoolRangePart;
+typedef struct _ThreadpoolRangePart _ThreadpoolRangePart;
+struct _ThreadpoolRangePart {
+  _ThreadpoolRange *range;
+  void *acc;
+};
+
+// Claims chunks until the range runs out. Every participant runs this, so
+// there's nothing to allocate per chunk. next never moves past end, so
+// ranges that end near SIZE_MAX don't wrap around.
+static inline void _Threadpool_range_task(void *part_arg) {
+  _ThreadpoolRangePart *part = (_ThreadpoolRangePart *)part_arg;
+  _ThreadpoolRange *range = part->range;
+  size_t begin = atomic_load_explicit(&(range->next), memory_order_relaxed);
+  while (true) {
+    if (begin >= range->end)
+      return;
+    size_t end = range->end - begin > range->grain ? begin + range->grain
+                                                   : range->end;
+    if (!atomic_compare_exchange_weak_explicit(&(range->next), &begin, end,
+                                               memory_order_relaxed,
+                                               memory_order_relaxed))
+      continue;
+    if (range->reduce_fn)
+      range->reduce_fn(begin, end, range->ctx, part->acc);
+    else
+      range->for_fn(begin, end, range->ctx);
+    begin = end;
+  }
+}
+
+// How many workers to bring in for a range, and the grain to split it by.
+static inline size_t _Threadpool_range_plan(Threadpool *pool, size_t len,
+                                            size_t *grain) {
+  size_t workers =
+      atomic_load_explicit(&(pool->num_threads), memory_order_relaxed);
+  if (workers > THREADPOOL_RANGE_HELPERS)
+    workers = THREADPOOL_RANGE_HELPERS;
+  if (!*grain) {
+    *grain = len / ((workers + 1) * THREADPOOL_CHUNKS_PER_THREAD);
+    if (!*grain)
+      *grain = 1;
+  }
+  size_t chunks = len / *grain + (len % *grain != 0);
+  return chunks - 1 < workers ? chunks - 1 : workers;
+}
+
+// Runs the parts on the pool and the calling thread, and returns when
+// they're all done. parts[0] belongs to the caller.
+static inline void _Threadpool_range_run(Threadpool *pool,
+                                         _ThreadpoolRangePart *parts,
+                                         size_t helpers) {
+  WaitGroup wg;
+  WaitGroup_init(&wg);
+
+  void *args[helpers + 1];
+  for (size_t i = 0; i < helpers; i++)
+    args[i] = parts + i + 1;
+  bool helped =
+      helpers && Threadpool_exectask_batch_group(pool, _Threadpool_range_task,
+                                                 args, helpers, &wg);
+
+  // Help out. If the pool is shut down, that means doing it all ourselves.
+  _Threadpool_range_task(parts);
+  if (helped)
+    Threadpool_await(pool, &wg);
+  WaitGroup_destroy(&wg);
+}
+
+// Calls fn(chunk_begin, chunk_end, ctx) over consecutive chunks covering
+// [begin, end), spread over the pool's workers and the calling thread, and
+// returns once every chunk is done. Chunks are grain indices long. Pass 0 to
+// have it picked based on the size of the range and the pool.
+//
+// It's fine to call this from inside a task.
+static inline void
+Threadpool_parallel_for(Threadpool *pool, size_t begin, size_t end,
+                        size_t grain,
+                        void (*fn)(size_t begin, size_t end, void *ctx),
+                        void *ctx) {
+  if (begin >= end)
+    return;
+
+  _ThreadpoolRange range;
+  atomic_init(&(range.next), begin);
+  range.end = end;
+  range.grain = grain;
+  range.for_fn = fn;
+  range.reduce_fn = NULL;
+  range.ctx = ctx;
+  size_t helpers = _Threadpool_range_plan(pool, end - begin, &(range.grain));
+
+  _ThreadpoolRangePart parts[helpers + 1];
+  for (size_t i = 0; i <= helpers; i++) {
+    parts[i].range = &range;
+    parts[i].acc = NULL;
+  }
+  _Threadpool_range_run(pool, parts, helpers);
+}
+
+// Reduces [begin, end) in parallel. result must start out holding the
+// identity value, which is acc_size bytes long, and holds the answer when
+// this returns. Returns false without doing anything if acc_size is 0 or the
+// accumulators don't fit on the stack and can't be malloc()ed either.
+//
+// Each participating thread copies the identity into its own accumulator and
+// folds chunks into it with reduce_fn(chunk_begin, chunk_end, ctx, acc). The
+// accumulators are then merged into result with combine_fn(result, acc, ctx).
+// Which chunks land in which accumulator is not deterministic, so combine_fn
+// should be associative and commutative.
+static inline bool Threadpool_parallel_reduce(
+    Threadpool *pool, size_t begin, size_t end, size_t grain,
+    void (*reduce_fn)(size_t begin, size_t end, void *ctx, void *acc),
+    void (*combine_fn)(void *result, void *acc, void *ctx), void *ctx,
+    void *result, size_t acc_size) {
+  if (!acc_size)
+    return 0;
+  if (begin >= end)
+    return 1;
+
+  _ThreadpoolRange range;
+  atomic_init(&(range.next), begin);
+  range.end = end;
+  range.grain = grain;
+  range.for_fn = NULL;
+  range.reduce_fn = reduce_fn;
+  range.ctx = ctx;
+  size_t helpers = _Threadpool_range_plan(pool, end - begin, &(range.grain));
+
+  // Every accumulator gets its own max-aligned slot.
+  size_t slot = (acc_size + sizeof(max_align_t) - 1) / sizeof(max_align_t);
+  size_t accs_size = (helpers + 1) * slot * sizeof(max_align_t);
+  max_align_t stack_accs[THREADPOOL_REDUCE_STACK / sizeof(max_align_t)];
+  max_align_t *accs = accs_size <= sizeof(stack_accs)
+                          ? stack_accs
+                          : (max_align_t *)malloc(accs_size);
+  if (!accs)
+    return 0;
+  _ThreadpoolRangePart parts[helpers + 1];
+  for (size_t i = 0; i <= helpers; i++) {
+    parts[i].range = &range;
+    parts[i].acc = accs + i * slot;
+    memcpy(parts[i].acc, result, acc_size);
   }
+  _Threadpool_range_run(pool, parts, helpers);
+
+  for (size_t i = 0; i <= helpers; i++)
+    combine_fn(result, parts[i].acc, ctx);
+  if (accs != stack_accs)
+    free(accs);
+  return 1;
+}
+
+static inline void _Threadpool_shutdown(Threadpool *pool, bool drop_pending) {
+  Threadpool_CRITICAL_BEGIN;
+  atomic_store_explicit(&(pool->drop_pending), drop_pending,
+                        memory_order_relaxed);
+  atomic_store_explicit(&(pool->is_shutdown), true, memory_order_release);
+  pool->wake_epoch++;
+  cond_broadcast(&(pool->work_cond));
+  cond_broadcast(&(pool->space_cond));
+  Threadpool_CRITICAL_END;
+
+  // Wait for the workers to drain the pool and exit. Nothing starts or
+  // retires once the pool is shut down, so the slots stay as they are.
+  for (size_t i = 0; i < pool->max_threads; i++)
+    if (pool->workers[i].state != _THREADPOOL_SLOT_EMPTY)
+      pthread_join(pool->workers[i].thread, NULL);
+
+  // Submitters that were waiting for room have given up. Let them get out.
+  Threadpool_CRITICAL_BEGIN;
+  while (atomic_load_explicit(&(pool->num_blocked), memory_order_relaxed))
+    cond_wait(&(pool->blocked_cond), &(pool->pool_mutex));
+  Threadpool_CRITICAL_END;
 
   // Now the pool is completely finished and all threads are joined.
   // Tear down the last remaining resources we're using.
   mutex_destroy(&(pool->pool_mutex));
-  free(pool->threads);
+  cond_destroy(&(pool->work_cond));
+  cond_destroy(&(pool->space_cond));
+  cond_destroy(&(pool->blocked_cond));
+  while (pool->slabs) {
+    TaskSlab *next = pool->slabs->next;
+    free(pool->slabs);
+    pool->slabs = next;
+  }
+  for (size_t i = 0; i < pool->max_threads; i++)
+    Arena_destroy(&(pool->workers[i].arena), false, false);
+  free(pool->workers_alloc);
+}
+
+// Only destroy once, and not before the threadpool is created.
+// Runs every task that was already submitted, then joins the workers.
+static inline void Threadpool_destroy(Threadpool *pool) {
+  _Threadpool_shutdown(pool, false);
+}
+
+// Like Threadpool_destroy(), but drops the tasks that haven't started yet
+// instead of running them. Tasks that are already running are waited on.
+// Dropped tasks still count down their wait groups and futures, so anything
+// waiting on them wakes up. Check your own flags to tell whether they ran.
+static inline void Threadpool_destroy_now(Threadpool *pool) {
+  _Threadpool_shutdown(pool, true);
 }
 
-#endif
\ No newline at end of file
+#endif
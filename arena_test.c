@@ -0,0 +1,167 @@
+#include <apaz-libc/arena.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Fills the arena with n allocations of size bytes, each aligned to align,
+// and checks that every one of them is.
+static int fill(Arena* arena, size_t n, size_t size, size_t align) {
+    for (size_t i = 0; i < n; i++) {
+        char* p = (char*)Arena_malloc_aligned(arena, size, align);
+        if ((uintptr_t)p % align) {
+            printf("Allocation %zu of %zu bytes isn't aligned to %zu.\n", i,
+                   size, align);
+            return 1;
+        }
+        memset(p, (int)i, size);
+    }
+    return 0;
+}
+
+int main() {
+    Arena arena = Arena_new((char*)"test");
+
+    // Each chunk is twice as big as the one before it.
+    if (fill(&arena, 8 * ARENA_SIZE / 1024, 1024, 16))
+        return 1;
+    ArenaStats stats = Arena_stats(&arena);
+    if (stats.chunks != 3 || stats.capacity != 8 * ARENA_SIZE) {
+        printf("Filled %zu bytes, and got %zu chunks holding %zu.\n",
+               stats.in_use, stats.chunks, stats.capacity);
+        return 1;
+    }
+
+    // Alignment holds past what malloc() gives, across chunk boundaries and
+    // with odd sizes in between.
+    for (size_t i = 0; i < 1000; i++) {
+        if (fill(&arena, 1, 3, 1) || fill(&arena, 1, 100, 32) ||
+            fill(&arena, 1, 7, 64) || fill(&arena, 1, 2000, 64))
+            return 1;
+    }
+    void* p = Arena_malloc(&arena, 5);
+    if ((uintptr_t)p % ALIGNOF(max_align_t)) {
+        printf("Arena_malloc() isn't aligned like malloc().\n");
+        return 1;
+    }
+
+    // Allocations too big for a chunk get their own, and aren't chunks.
+    stats = Arena_stats(&arena);
+    size_t big = ARENA_MAX_CHUNK_SIZE / 4 + 1;
+    memset(Arena_malloc(&arena, big), 1, big);
+    ArenaStats after = Arena_stats(&arena);
+    if (after.oversize != stats.oversize + 1 || after.chunks != stats.chunks) {
+        printf("An oversize allocation was counted as %zu oversize and %zu "
+               "chunks.\n",
+               after.oversize - stats.oversize, after.chunks - stats.chunks);
+        return 1;
+    }
+
+    // Rewinding restores what was in use, frees the oversize allocations
+    // made since, and the same space gets handed out again.
+    Arena_reset(&arena);
+    Arena_malloc(&arena, 100);
+    ArenaMark mark = Arena_mark(&arena);
+    stats = Arena_stats(&arena);
+    void* first = Arena_malloc(&arena, 100);
+    for (int round = 0; round < 3; round++) {
+        if (fill(&arena, 4 * ARENA_SIZE / 1024, 1024, 16))
+            return 1;
+        memset(Arena_malloc(&arena, big), 2, big);
+        if (fill(&arena, 4 * ARENA_SIZE / 1024, 1024, 16))
+            return 1;
+        Arena_rewind(&arena, mark);
+        after = Arena_stats(&arena);
+        if (after.in_use != stats.in_use) {
+            printf("Rewinding left %zu bytes in use, not %zu.\n",
+                   after.in_use, stats.in_use);
+            return 1;
+        }
+        if (after.capacity >= stats.capacity + big) {
+            printf("Rewinding held on to an oversize allocation.\n");
+            return 1;
+        }
+        if (Arena_malloc(&arena, 100) != first) {
+            printf("Rewinding didn't give back the space.\n");
+            return 1;
+        }
+    }
+
+    // Chunks are kept over resets, so filling the arena the same way again
+    // doesn't allocate any more of them.
+    Arena_reset(&arena);
+    if (fill(&arena, 8 * ARENA_SIZE / 1024, 1024, 16))
+        return 1;
+    stats = Arena_stats(&arena);
+    for (int round = 0; round < 5; round++) {
+        Arena_reset(&arena);
+        if (Arena_stats(&arena).in_use) {
+            printf("Resetting left %zu bytes in use.\n",
+                   Arena_stats(&arena).in_use);
+            return 1;
+        }
+        if (fill(&arena, 8 * ARENA_SIZE / 1024, 1024, 16))
+            return 1;
+        after = Arena_stats(&arena);
+        if (after.chunks != stats.chunks || after.in_use != stats.in_use) {
+            printf("Refilling after a reset made %zu chunks, not %zu.\n",
+                   after.chunks, stats.chunks);
+            return 1;
+        }
+    }
+    if (after.resets != stats.resets + 5) {
+        printf("Counted %zu resets, not %zu.\n", after.resets,
+               stats.resets + 5);
+        return 1;
+    }
+
+    Arena_print_stats(&arena);
+    Arena_destroy(&arena, false, true);
+
+    // Virtual arenas hand out one contiguous run of memory, for as long as
+    // the reservation lasts.
+    size_t reserve = 256 * 4096;
+    Arena virt;
+    Arena_init_virtual(&virt, (char*)"virtual", reserve, false);
+    if (!virt.reserved) {
+        printf("Couldn't reserve address space, skipping virtual arenas.\n");
+        return 0;
+    }
+    char* base = (char*)Arena_malloc(&virt, 4096);
+    for (size_t i = 1; i < reserve / 4096; i++) {
+        char* page = (char*)Arena_malloc(&virt, 4096);
+        if (page != base + i * 4096) {
+            printf("Virtual arena allocation %zu isn't contiguous.\n", i);
+            return 1;
+        }
+        memset(page, 3, 4096);
+    }
+    memset(base, 3, 4096);
+    if (Arena_stats(&virt).chunks) {
+        printf("A virtual arena made chunks before it was full.\n");
+        return 1;
+    }
+
+    // Past the reservation, it carries on in chunks.
+    char* past = (char*)Arena_malloc(&virt, 4096);
+    memset(past, 4, 4096);
+    if ((past >= base && past < base + reserve) ||
+        Arena_stats(&virt).chunks != 1) {
+        printf("A full virtual arena didn't move on to a chunk.\n");
+        return 1;
+    }
+
+    // Trimming gives the pages back, and they read as zeros afterwards.
+    Arena_reset(&virt);
+    Arena_trim(&virt);
+    for (size_t i = 0; i < reserve; i++) {
+        if (base[i]) {
+            printf("Byte %zu of a trimmed virtual arena isn't zero.\n", i);
+            return 1;
+        }
+    }
+    if (Arena_malloc(&virt, 4096) != base ||
+        Arena_stats(&virt).capacity != reserve) {
+        printf("A trimmed virtual arena didn't start over.\n");
+        return 1;
+    }
+    Arena_destroy(&virt, false, false);
+}
@@ -1,4 +1,7 @@
 #include <apaz-libc/list.h>
+// Lists defined after including arena.h also get _on() functions, which
+// allocate them on an Arena.
+#include <apaz-libc/arena.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -16,6 +19,8 @@ LIST_DEFINE(size_t);
 LIST_DEFINE(List_size_t);
 // This is the fun part. (original type, map to type)
 LIST_DEFINE_MONAD(size_t, size_t);
+// Small lists keep their first few elements inside the struct, no malloc().
+LIST_DEFINE_SMALL(size_t, 4);
 
 int main() {
   // The type of the list is List_##type, as provided to LIST_DEFINE. There
@@ -31,6 +36,10 @@ int main() {
   List_size_t_add(&list, 11);
   list = List_size_t_addeq(list, 12);
 
+  // If you know how many you're going to add, reserve room for them first, and
+  // the list only has to grow once.
+  list = List_size_t_reserve(list, 100);
+
   // You can also peek and pop.
   size_t peeked = List_size_t_peek(list);
   List_size_t_pop(list);
@@ -48,4 +57,43 @@ int main() {
   // list they re-use the space allocated for the old one where possible.
   cloned = List_size_t_map_to_size_t(cloned, factorial);
   List_size_t_foreach(cloned, print_size);
-}
\ No newline at end of file
+
+  // A small list starts out in the struct, and moves to the heap when it
+  // outgrows it. Either way, sl.list is a normal list. Don't hand it to
+  // functions that destroy it though, like foreach().
+  SmallList_size_t_4 sl;
+  SmallList_size_t_4_init(&sl);
+  for (size_t i = 0; i < 4; i++)
+    SmallList_size_t_4_add(&sl, i);
+  if (!SmallList_size_t_4_is_inline(&sl))
+    return 1;
+  SmallList_size_t_4_add(&sl, 4);
+  if (SmallList_size_t_4_is_inline(&sl))
+    return 1;
+  for (size_t i = 5; i < 20; i++)
+    SmallList_size_t_4_add(&sl, i);
+  if (List_size_t_len(sl.list) != 20 || sl.list[0] != 0 || sl.list[19] != 19)
+    return 1;
+  for (size_t i = 0; i < List_size_t_len(sl.list); i++)
+    print_size(sl.list[i]);
+  SmallList_size_t_4_destroy(&sl);
+
+  // Lists can live on an Arena too. Use the _on() functions to make and grow
+  // them, and don't destroy them. Rewinding the arena frees them all at once,
+  // and the next lists reuse the space.
+  Arena arena;
+  Arena_init(&arena, (char *)"lists", NULL, 0);
+  ArenaMark start = Arena_mark(&arena);
+  for (size_t round = 0; round < 2; round++) {
+    List_size_t on_arena = List_size_t_new_cap_on(&arena, 0);
+    for (size_t i = 0; i < 1000; i++)
+      on_arena = List_size_t_addeq_on(&arena, on_arena, i * round);
+    List_size_t copy = List_size_t_clone_on(&arena, on_arena);
+    if (List_size_t_len(copy) != 1000 || copy[999] != 999 * round)
+      return 1;
+    Arena_rewind(&arena, start);
+    if (Arena_stats(&arena).in_use)
+      return 1;
+  }
+  Arena_destroy(&arena, false, false);
+}
@@ -0,0 +1,109 @@
+#include <apaz-libc/pool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Build with: gcc -O2 pool_bench.c
+//
+// Compares Pool_##type against malloc() and free() for objects from 16 to 256
+// bytes. Churn keeps a working set of live objects and replaces one at random
+// each step, like a long-lived container of nodes. Bulk allocates a batch and
+// frees all of it, like a structure that's built and torn down.
+
+#define LIVE_OBJECTS 10000
+#define CHURN_STEPS 10000000
+#define BULK_OBJECTS 100000
+#define BULK_ROUNDS 50
+
+static inline double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t next_rand(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static void *live[BULK_OBJECTS];
+
+// Touch each object as it's handed out, so that neither side gets away with
+// memory that's never written.
+#define BENCH_SIZE(size)                                                       \
+  typedef struct {                                                             \
+    char bytes[size];                                                          \
+  } Obj##size;                                                                 \
+  POOL_DEFINE(Obj##size)                                                       \
+                                                                               \
+  static inline void bench_##size(void) {                                      \
+    uint64_t rng = 88172645463325252ull;                                       \
+    double start = now_sec();                                                  \
+    for (size_t i = 0; i < LIVE_OBJECTS; i++)                                  \
+      ((char *)(live[i] = malloc(size)))[0] = 1;                               \
+    for (size_t i = 0; i < CHURN_STEPS; i++) {                                 \
+      size_t j = next_rand(&rng) % LIVE_OBJECTS;                               \
+      free(live[j]);                                                           \
+      ((char *)(live[j] = malloc(size)))[0] = 1;                               \
+    }                                                                          \
+    for (size_t i = 0; i < LIVE_OBJECTS; i++)                                  \
+      free(live[i]);                                                           \
+    double malloc_churn = now_sec() - start;                                   \
+                                                                               \
+    start = now_sec();                                                         \
+    for (size_t r = 0; r < BULK_ROUNDS; r++) {                                 \
+      for (size_t i = 0; i < BULK_OBJECTS; i++)                                \
+        ((char *)(live[i] = malloc(size)))[0] = 1;                             \
+      for (size_t i = 0; i < BULK_OBJECTS; i++)                                \
+        free(live[i]);                                                         \
+    }                                                                          \
+    double malloc_bulk = now_sec() - start;                                    \
+                                                                               \
+    Pool_Obj##size pool;                                                       \
+    Pool_Obj##size##_init(&pool);                                              \
+    rng = 88172645463325252ull;                                                \
+    start = now_sec();                                                         \
+    for (size_t i = 0; i < LIVE_OBJECTS; i++)                                  \
+      ((char *)(live[i] = Pool_Obj##size##_alloc(&pool)))[0] = 1;              \
+    for (size_t i = 0; i < CHURN_STEPS; i++) {                                 \
+      size_t j = next_rand(&rng) % LIVE_OBJECTS;                               \
+      Pool_Obj##size##_free(&pool, (Obj##size *)live[j]);                      \
+      ((char *)(live[j] = Pool_Obj##size##_alloc(&pool)))[0] = 1;              \
+    }                                                                          \
+    for (size_t i = 0; i < LIVE_OBJECTS; i++)                                  \
+      Pool_Obj##size##_free(&pool, (Obj##size *)live[i]);                      \
+    double pool_churn = now_sec() - start;                                     \
+                                                                               \
+    start = now_sec();                                                         \
+    for (size_t r = 0; r < BULK_ROUNDS; r++) {                                 \
+      for (size_t i = 0; i < BULK_OBJECTS; i++)                                \
+        ((char *)(live[i] = Pool_Obj##size##_alloc(&pool)))[0] = 1;            \
+      for (size_t i = 0; i < BULK_OBJECTS; i++)                                \
+        Pool_Obj##size##_free(&pool, (Obj##size *)live[i]);                    \
+    }                                                                          \
+    double pool_bulk = now_sec() - start;                                      \
+    Pool_Obj##size##_destroy(&pool);                                           \
+                                                                               \
+    printf("%3d bytes: churn malloc %5.1fns pool %5.1fns, "                    \
+           "bulk malloc %5.1fns pool %5.1fns\n",                               \
+           size, malloc_churn * 1e9 / CHURN_STEPS,                             \
+           pool_churn * 1e9 / CHURN_STEPS,                                     \
+           malloc_bulk * 1e9 / (BULK_ROUNDS * BULK_OBJECTS),                   \
+           pool_bulk * 1e9 / (BULK_ROUNDS * BULK_OBJECTS));                    \
+  }
+
+BENCH_SIZE(16)
+BENCH_SIZE(32)
+BENCH_SIZE(64)
+BENCH_SIZE(128)
+BENCH_SIZE(256)
+
+int main(void) {
+  bench_16();
+  bench_32();
+  bench_64();
+  bench_128();
+  bench_256();
+}
@@ -0,0 +1,126 @@
+#include <apaz-libc/pool.h>
+#include <apaz-libc/threadpool.h>
+#include <stdio.h>
+
+typedef struct {
+    size_t owner;
+    size_t index;
+    char payload[40];
+} Obj;
+
+POOL_DEFINE(Obj)
+
+#define THREADS 8
+#define OBJS 5000
+
+typedef struct {
+    size_t id;
+    Pool_Obj_Cache cache;
+    Obj* objs[OBJS];
+    size_t spoiled;
+} User;
+
+// Allocates a batch of objects from the user's cache of the shared pool, and
+// marks each one as its own.
+void take(void* voidptr) {
+    User* u = (User*)voidptr;
+    for (size_t i = 0; i < OBJS; i++) {
+        u->objs[i] = Pool_Obj_Cache_alloc(&(u->cache));
+        u->objs[i]->owner = u->id;
+        u->objs[i]->index = i;
+        memset(u->objs[i]->payload, (int)u->id, sizeof(u->objs[i]->payload));
+    }
+}
+
+// Checks that nobody else was handed the user's objects, then gives them all
+// back to the shared pool.
+void give_back(void* voidptr) {
+    User* u = (User*)voidptr;
+    for (size_t i = 0; i < OBJS; i++)
+        if (u->objs[i]->owner != u->id || u->objs[i]->index != i ||
+            u->objs[i]->payload[39] != (char)u->id)
+            u->spoiled++;
+    for (size_t i = 0; i < OBJS; i++)
+        Pool_Obj_Cache_free(&(u->cache), u->objs[i]);
+    Pool_Obj_Cache_flush(&(u->cache));
+}
+
+size_t shared_chunks(Pool_Obj_Shared* shared) {
+    return Arena_stats(&(shared->pool.arena)).chunks;
+}
+
+int main() {
+    // A pool hands the most recently freed object back out first.
+    Pool_Obj pool;
+    Pool_Obj_init(&pool);
+    Obj* a = Pool_Obj_alloc(&pool);
+    Obj* b = Pool_Obj_alloc(&pool);
+    if (a == b) {
+        printf("The pool handed out the same object twice.\n");
+        return 1;
+    }
+    Pool_Obj_free(&pool, a);
+    if (Pool_Obj_alloc(&pool) != a) {
+        printf("The pool didn't reuse a freed object.\n");
+        return 1;
+    }
+    Pool_Obj_reset(&pool);
+    if (Pool_Obj_alloc(&pool) != a) {
+        printf("The pool didn't start over after a reset.\n");
+        return 1;
+    }
+    Pool_Obj_destroy(&pool);
+
+    // Each thread's local pool is its own.
+    if (Pool_Obj_local() != Pool_Obj_local()) {
+        printf("Pool_Obj_local() isn't the same pool every time.\n");
+        return 1;
+    }
+    Pool_Obj_free(Pool_Obj_local(), Pool_Obj_alloc(Pool_Obj_local()));
+
+    // Many threads share one pool through their caches.
+    Threadpool threadpool;
+    Threadpool_create(&threadpool, THREADS);
+    Pool_Obj_Shared shared;
+    Pool_Obj_Shared_init(&shared);
+    static User users[THREADS];
+    for (size_t t = 0; t < THREADS; t++) {
+        users[t].id = t;
+        users[t].spoiled = 0;
+        Pool_Obj_Cache_init(&(users[t].cache), &shared);
+    }
+
+    size_t chunks = 0;
+    for (int round = 0; round < 5; round++) {
+        WaitGroup wg;
+        WaitGroup_init(&wg);
+        for (size_t t = 0; t < THREADS; t++)
+            Threadpool_exectask_group(&threadpool, take, users + t, &wg);
+        Threadpool_await(&threadpool, &wg);
+        for (size_t t = 0; t < THREADS; t++)
+            Threadpool_exectask_group(&threadpool, give_back, users + t, &wg);
+        Threadpool_await(&threadpool, &wg);
+        WaitGroup_destroy(&wg);
+
+        for (size_t t = 0; t < THREADS; t++) {
+            if (users[t].spoiled) {
+                printf("User %zu's objects were handed out to someone else.\n",
+                       t);
+                return 1;
+            }
+        }
+
+        // Everything was given back, so later rounds take the same objects
+        // again and the shared pool doesn't grow.
+        if (!round)
+            chunks = shared_chunks(&shared);
+        else if (shared_chunks(&shared) != chunks) {
+            printf("The shared pool grew from %zu to %zu chunks.\n", chunks,
+                   shared_chunks(&shared));
+            return 1;
+        }
+    }
+
+    Pool_Obj_Shared_destroy(&shared);
+    Threadpool_destroy(&threadpool);
+}
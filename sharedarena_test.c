@@ -0,0 +1,153 @@
+#include <apaz-libc/sharedarena.h>
+#include <apaz-libc/threadpool.h>
+#include <stdio.h>
+
+#define THREADS 8
+#define ALLOCS 20000
+
+typedef struct {
+    SharedArena* arena;
+    size_t id;
+    size_t n;
+    char* ptrs[ALLOCS + 1];
+    size_t sizes[ALLOCS + 1];
+    size_t misaligned;
+} Allocator;
+
+// Mixed sizes and alignments, up to 64 bytes. Every allocation is filled with
+// a byte that's different for each thread, so if two of them overlapped, the
+// one written first would be spoiled.
+void allocate(void* voidptr) {
+    Allocator* a = (Allocator*)voidptr;
+    for (size_t i = 0; i < a->n; i++) {
+        size_t size = (i * 7 + a->id) % 300 + 1;
+        size_t align = (size_t)1 << (i % 7);
+        char* p = (char*)SharedArena_malloc_aligned(a->arena, size, align);
+        if ((uintptr_t)p % align)
+            a->misaligned++;
+        memset(p, (int)a->id + 1, size);
+        a->ptrs[i] = p;
+        a->sizes[i] = size;
+    }
+
+    // Every other thread also makes one allocation too big for a chunk.
+    a->ptrs[a->n] = NULL;
+    if (a->id % 2) {
+        size_t big = ARENA_MAX_CHUNK_SIZE / 4 + 1;
+        a->ptrs[a->n] = (char*)SharedArena_malloc_aligned(a->arena, big, 64);
+        a->sizes[a->n] = big;
+        if ((uintptr_t)a->ptrs[a->n] % 64)
+            a->misaligned++;
+        memset(a->ptrs[a->n], (int)a->id + 1, big);
+    }
+}
+
+typedef struct {
+    char* begin;
+    char* end;
+} Span;
+
+int by_begin(const void* a, const void* b) {
+    char* x = ((const Span*)a)->begin;
+    char* y = ((const Span*)b)->begin;
+    return (x > y) - (x < y);
+}
+
+// Runs the allocators side by side, then checks what they got.
+int run(Threadpool* pool, Allocator* allocators, size_t n) {
+    WaitGroup wg;
+    WaitGroup_init(&wg);
+    for (size_t t = 0; t < THREADS; t++) {
+        allocators[t].n = n;
+        allocators[t].misaligned = 0;
+        Threadpool_exectask_group(pool, allocate, allocators + t, &wg);
+    }
+    Threadpool_await(pool, &wg);
+    WaitGroup_destroy(&wg);
+
+    static Span spans[THREADS * (ALLOCS + 1)];
+    size_t num_spans = 0;
+    for (size_t t = 0; t < THREADS; t++) {
+        Allocator* a = allocators + t;
+        if (a->misaligned) {
+            printf("Thread %zu got %zu misaligned allocations.\n", t,
+                   a->misaligned);
+            return 1;
+        }
+        for (size_t i = 0; i <= a->n; i++) {
+            if (!a->ptrs[i])
+                continue;
+            for (size_t b = 0; b < a->sizes[i]; b++) {
+                if (a->ptrs[i][b] != (char)(t + 1)) {
+                    printf("Thread %zu's allocation %zu was overwritten.\n", t,
+                           i);
+                    return 1;
+                }
+            }
+            spans[num_spans].begin = a->ptrs[i];
+            spans[num_spans].end = a->ptrs[i] + a->sizes[i];
+            num_spans++;
+        }
+    }
+
+    qsort(spans, num_spans, sizeof(Span), by_begin);
+    for (size_t i = 1; i < num_spans; i++) {
+        if (spans[i].begin < spans[i - 1].end) {
+            printf("Two allocations overlap.\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+size_t count_chunks(SharedArena* arena) {
+    size_t n = 0;
+    for (SharedArenaChunk* chunk = arena->chunks; chunk; chunk = chunk->next)
+        n++;
+    return n;
+}
+
+int main() {
+    Threadpool pool;
+    Threadpool_create(&pool, THREADS);
+
+    SharedArena arena;
+    SharedArena_init(&arena, (char*)"shared");
+    static Allocator allocators[THREADS];
+    for (size_t t = 0; t < THREADS; t++) {
+        allocators[t].arena = &arena;
+        allocators[t].id = t;
+    }
+
+    if (run(&pool, allocators, ALLOCS))
+        return 1;
+    size_t chunks = count_chunks(&arena);
+    size_t oversize = 0;
+    for (SharedArenaChunk* big = arena.oversize; big; big = big->next)
+        oversize++;
+    if (oversize != THREADS / 2) {
+        printf("Made %zu oversize allocations, not %d.\n", oversize,
+               THREADS / 2);
+        return 1;
+    }
+
+    // After a reset, the chunks are handed out again. Allocating less than
+    // the first time around fits in them without making more.
+    for (int round = 0; round < 3; round++) {
+        SharedArena_reset(&arena);
+        if (arena.oversize) {
+            printf("SharedArena_reset() kept the oversize allocations.\n");
+            return 1;
+        }
+        if (run(&pool, allocators, ALLOCS / 2))
+            return 1;
+        if (count_chunks(&arena) != chunks) {
+            printf("Reallocating after a reset made %zu chunks, not %zu.\n",
+                   count_chunks(&arena), chunks);
+            return 1;
+        }
+    }
+
+    SharedArena_destroy(&arena);
+    Threadpool_destroy(&pool);
+}
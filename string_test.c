@@ -31,6 +31,23 @@ int main() {
     We can destroy all the strings in the list inside the monad. */
   List_String_foreach(l, String_printAndDestroy);
 
+  /* Strings can also be built on an Arena. There's no need to destroy them
+     one by one. Rewinding the arena to a mark frees everything allocated on
+     it since, and the space gets reused. */
+  Arena arena;
+  Arena_init(&arena, (char *)"strings", NULL, 0);
+  ArenaMark start = Arena_mark(&arena);
+  for (int round = 0; round < 2; round++) {
+    String greeting = String_new_of_strlen_on(&arena, "Hello");
+    greeting = String_append_on(&arena, greeting,
+                                String_new_of_strlen_on(&arena, ", Arena"));
+    assert(String_equals(greeting, "Hello, Arena"));
+    String_println(greeting);
+    Arena_rewind(&arena, start);
+    assert(Arena_stats(&arena).in_use == 0);
+  }
+  Arena_destroy(&arena, false, false);
+
   print_heap();
   puts("All memory cleaned up.");
 }
\ No newline at end of file
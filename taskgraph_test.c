@@ -0,0 +1,66 @@
+// Track every allocation, so freeing anything the wrappers didn't hand out
+// stops the test.
+#define MEMDEBUG 1
+#include <apaz-libc/taskgraph.h>
+#include <stdio.h>
+
+// Each task records when it ran, relative to the others.
+static _Atomic size_t clock_ticks = 0;
+static size_t ran_at[5];
+
+void step(void* voidptr) {
+    ran_at[(size_t)voidptr] = atomic_fetch_add(&clock_ticks, 1);
+}
+
+int main() {
+    Threadpool pool;
+    Threadpool_create(&pool, 4);
+
+    // A diamond. load comes first, parse and check can run side by side
+    // after it, and save waits for both of them.
+    TaskGraph graph;
+    TaskGraph_init(&graph);
+    size_t load = TaskGraph_add(&graph, step, (void*)0);
+    size_t parse = TaskGraph_add(&graph, step, (void*)1);
+    size_t check = TaskGraph_add(&graph, step, (void*)2);
+    size_t save = TaskGraph_add(&graph, step, (void*)3);
+    TaskGraph_depend(&graph, parse, load);
+    TaskGraph_depend(&graph, check, load);
+    TaskGraph_depend(&graph, save, parse);
+    TaskGraph_depend(&graph, save, check);
+
+    // Ids that aren't in the graph are turned away.
+    if (TaskGraph_depend(&graph, save, 4) || TaskGraph_depend(&graph, 4, load)) {
+        printf("TaskGraph_depend() took a task that doesn't exist.\n");
+        return 1;
+    }
+
+    // Graphs can be run as many times as you like.
+    for (int run = 0; run < 100; run++) {
+        if (!TaskGraph_run(&graph, &pool)) {
+            printf("TaskGraph_run() found a cycle that isn't there.\n");
+            return 1;
+        }
+        if (ran_at[parse] < ran_at[load] || ran_at[check] < ran_at[load] ||
+            ran_at[save] < ran_at[parse] || ran_at[save] < ran_at[check]) {
+            printf("A task ran before one it depends on.\n");
+            return 1;
+        }
+    }
+    TaskGraph_destroy(&graph);
+
+    // A graph with a cycle would never finish, so it isn't run at all.
+    TaskGraph cycle;
+    TaskGraph_init(&cycle);
+    size_t a = TaskGraph_add(&cycle, step, (void*)4);
+    size_t b = TaskGraph_add(&cycle, step, (void*)4);
+    TaskGraph_depend(&cycle, a, b);
+    TaskGraph_depend(&cycle, b, a);
+    if (TaskGraph_run(&cycle, &pool)) {
+        printf("TaskGraph_run() ran a graph with a cycle.\n");
+        return 1;
+    }
+    TaskGraph_destroy(&cycle);
+
+    Threadpool_destroy(&pool);
+}
@@ -0,0 +1,234 @@
+#include <apaz-libc/threadpool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+// Build with: gcc -O2 -pthread threadpool_bench.c
+//
+// Add -DTHREADPOOL_SPIN_ITERS=SIZE_MAX to get the old behavior, where idle
+// workers spin on sched_yield() forever and never park. Add
+// -DTHREADPOOL_SPIN_ITERS=0 to park immediately without spinning. Add
+// -DTHREADPOOL_STATS=0 to see what the counters cost. Add
+// -DTHREADPOOL_NODE_MALLOC=1 to malloc() every task node instead of taking it
+// from a slab, which is the baseline for the submit numbers.
+
+#define BENCH_THREADS 8
+#define WAKEUP_SAMPLES 200
+#define TINY_TASKS 1000000
+#define FANOUT_DEPTH 18
+#define BATCH_SIZE 1000
+#define DELAY_ROUNDS 50
+#define DELAY_BURST 2000
+
+static inline double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline double cpu_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline void sleep_sec(double s) {
+  struct timespec ts = {.tv_sec = (time_t)s,
+                        .tv_nsec = (long)((s - (time_t)s) * 1e9)};
+  nanosleep(&ts, NULL);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static _Atomic double woke_at;
+static void record_wakeup(void *unused) {
+  (void)unused;
+  atomic_store(&woke_at, now_sec());
+}
+
+static _Atomic size_t tasks_done;
+static void tiny_task(void *unused) {
+  (void)unused;
+  atomic_fetch_add_explicit(&tasks_done, 1, memory_order_relaxed);
+}
+
+// Each task spawns two more until the tree is FANOUT_DEPTH deep, so nearly
+// all submissions come from inside the pool.
+static Threadpool *fanout_pool;
+static void fanout_task(void *depth) {
+  size_t d = (size_t)depth;
+  if (d) {
+    Threadpool_exectask(fanout_pool, fanout_task, (void *)(d - 1));
+    Threadpool_exectask(fanout_pool, fanout_task, (void *)(d - 1));
+  }
+  atomic_fetch_add_explicit(&tasks_done, 1, memory_order_relaxed);
+}
+
+static inline void await_tasks_done(size_t n) {
+  while (atomic_load(&tasks_done) < n)
+    sched_yield();
+}
+
+// Sustained load: bursts of small tasks arrive faster than they can be run,
+// with short lulls in between. Each task records how long it sat queued.
+static double delay_enqueued[DELAY_ROUNDS * DELAY_BURST];
+static double delay_waited[DELAY_ROUNDS * DELAY_BURST];
+static void delay_task(void *idx) {
+  size_t i = (size_t)idx;
+  double started = now_sec();
+  delay_waited[i] = (started - delay_enqueued[i]) * 1e6;
+  while (now_sec() - started < 2e-6)
+    ;
+  atomic_fetch_add_explicit(&tasks_done, 1, memory_order_relaxed);
+}
+
+static inline void bench_queueing_delay(size_t num_threads,
+                                        ThreadpoolOrder order) {
+  ThreadpoolConfig config = Threadpool_config(num_threads);
+  config.order = order;
+  Threadpool pool;
+  Threadpool_create_with(&pool, config);
+
+  atomic_store(&tasks_done, 0);
+  for (size_t r = 0; r < DELAY_ROUNDS; r++) {
+    for (size_t j = 0; j < DELAY_BURST; j++) {
+      size_t i = r * DELAY_BURST + j;
+      delay_enqueued[i] = now_sec();
+      Threadpool_exectask(&pool, delay_task, (void *)i);
+    }
+    sleep_sec(0.001);
+  }
+  await_tasks_done(DELAY_ROUNDS * DELAY_BURST);
+  Threadpool_destroy(&pool);
+
+  size_t n = DELAY_ROUNDS * DELAY_BURST;
+  qsort(delay_waited, n, sizeof(double), compare_doubles);
+  printf("%s queueing delay: p50 %.1fus, p99 %.1fus, max %.1fus\n",
+         order == THREADPOOL_FIFO ? "FIFO" : "LIFO", delay_waited[n / 2],
+         delay_waited[n * 99 / 100], delay_waited[n - 1]);
+}
+
+// The same load, but every tenth task is high priority and the rest are low.
+static inline void bench_priority_delay(size_t num_threads) {
+  Threadpool pool;
+  Threadpool_create(&pool, num_threads);
+
+  atomic_store(&tasks_done, 0);
+  for (size_t r = 0; r < DELAY_ROUNDS; r++) {
+    for (size_t j = 0; j < DELAY_BURST; j++) {
+      size_t i = r * DELAY_BURST + j;
+      delay_enqueued[i] = now_sec();
+      Threadpool_exectask_prio(&pool, delay_task, (void *)i,
+                               i % 10 ? THREADPOOL_PRIO_LOW
+                                      : THREADPOOL_PRIO_HIGH);
+    }
+    sleep_sec(0.001);
+  }
+  await_tasks_done(DELAY_ROUNDS * DELAY_BURST);
+  Threadpool_destroy(&pool);
+
+  // Split the delays by priority, high to the front.
+  size_t n = DELAY_ROUNDS * DELAY_BURST, high = n / 10;
+  static double split[DELAY_ROUNDS * DELAY_BURST];
+  size_t h = 0, l = high;
+  for (size_t i = 0; i < n; i++)
+    split[i % 10 ? l++ : h++] = delay_waited[i];
+  qsort(split, high, sizeof(double), compare_doubles);
+  qsort(split + high, n - high, sizeof(double), compare_doubles);
+  printf("High priority queueing delay: p50 %.1fus, p99 %.1fus\n",
+         split[high / 2], split[high * 99 / 100]);
+  printf("Low priority queueing delay: p50 %.1fus, p99 %.1fus\n",
+         split[high + (n - high) / 2], split[high + (n - high) * 99 / 100]);
+}
+
+int main(int argc, char **argv) {
+  size_t num_threads = argc > 1 ? (size_t)atoi(argv[1]) : BENCH_THREADS;
+
+  Threadpool pool;
+  Threadpool_create(&pool, num_threads);
+  printf("THREADPOOL_SPIN_ITERS: %zu, THREADPOOL_NODE_MALLOC: %d, "
+         "threads: %zu\n",
+         (size_t)THREADPOOL_SPIN_ITERS, THREADPOOL_NODE_MALLOC, num_threads);
+
+  // Idle CPU use. Let the workers settle, then see how much CPU time the
+  // process burns while nobody submits anything.
+  sleep_sec(0.1);
+  double wall_start = now_sec(), cpu_start = cpu_sec();
+  sleep_sec(1.0);
+  double wall = now_sec() - wall_start, cpu = cpu_sec() - cpu_start;
+  printf("Idle CPU: %.3f cores busy (%.3fs CPU over %.3fs)\n", cpu / wall, cpu,
+         wall);
+
+  // Wakeup latency. Give the pool time to go idle before each submission, then
+  // time how long it takes a worker to start the task.
+  double latencies[WAKEUP_SAMPLES];
+  for (size_t i = 0; i < WAKEUP_SAMPLES; i++) {
+    sleep_sec(0.005);
+    atomic_store(&woke_at, 0.0);
+    double submitted = now_sec();
+    Threadpool_exectask(&pool, record_wakeup, NULL);
+    double woke;
+    while ((woke = atomic_load(&woke_at)) == 0.0)
+      ;
+    latencies[i] = (woke - submitted) * 1e6;
+  }
+  qsort(latencies, WAKEUP_SAMPLES, sizeof(double), compare_doubles);
+  printf("Wakeup latency: p50 %.1fus, p99 %.1fus, max %.1fus\n",
+         latencies[WAKEUP_SAMPLES / 2], latencies[WAKEUP_SAMPLES * 99 / 100],
+         latencies[WAKEUP_SAMPLES - 1]);
+
+  // Tiny task throughput, submitted from outside the pool.
+  atomic_store(&tasks_done, 0);
+  double start = now_sec();
+  for (size_t i = 0; i < TINY_TASKS; i++)
+    Threadpool_exectask(&pool, tiny_task, NULL);
+  double submitted = now_sec() - start;
+  await_tasks_done(TINY_TASKS);
+  double elapsed = now_sec() - start;
+  printf("External submits: %.2f M submits/s\n", TINY_TASKS / submitted / 1e6);
+  printf("External tiny tasks: %.2f M tasks/s\n", TINY_TASKS / elapsed / 1e6);
+
+  // The same, submitted BATCH_SIZE at a time.
+  static void *batch_args[BATCH_SIZE];
+  atomic_store(&tasks_done, 0);
+  start = now_sec();
+  for (size_t i = 0; i < TINY_TASKS; i += BATCH_SIZE)
+    Threadpool_exectask_batch(&pool, tiny_task, batch_args, BATCH_SIZE);
+  submitted = now_sec() - start;
+  await_tasks_done(TINY_TASKS);
+  elapsed = now_sec() - start;
+  printf("Batched external submits: %.2f M submits/s\n",
+         TINY_TASKS / submitted / 1e6);
+  printf("Batched external tiny tasks: %.2f M tasks/s\n",
+         TINY_TASKS / elapsed / 1e6);
+
+  // Tiny task throughput, submitted from inside the pool.
+  size_t fanout_tasks = ((size_t)1 << (FANOUT_DEPTH + 1)) - 1;
+  fanout_pool = &pool;
+  atomic_store(&tasks_done, 0);
+  start = now_sec();
+  Threadpool_exectask(&pool, fanout_task, (void *)(size_t)FANOUT_DEPTH);
+  await_tasks_done(fanout_tasks);
+  elapsed = now_sec() - start;
+  printf("Fan-out tiny tasks: %.2f M tasks/s\n", fanout_tasks / elapsed / 1e6);
+
+  // What the pool saw of all that.
+  ThreadpoolStats stats = Threadpool_stats(&pool);
+  printf("Stats: %llu tasks, %llu steals, %.1f%% busy, p99 start latency "
+         "under %lluus\n",
+         (unsigned long long)stats.totals.tasks_run,
+         (unsigned long long)stats.totals.steals,
+         100.0 * stats.totals.busy_ns /
+             (stats.totals.busy_ns + stats.totals.idle_ns + 1),
+         (unsigned long long)ThreadpoolStats_latency_percentile(
+             &(stats.totals), 0.99) / 1000);
+
+  Threadpool_destroy(&pool);
+
+  bench_queueing_delay(num_threads, THREADPOOL_LIFO);
+  bench_queueing_delay(num_threads, THREADPOOL_FIFO);
+  bench_priority_delay(num_threads);
+}
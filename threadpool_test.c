@@ -6,6 +6,39 @@ void say_hello(void* voidptr) {
     free(voidptr);
 }
 
+void count_up(void* voidptr) {
+    atomic_fetch_add((_Atomic size_t*)voidptr, 1);
+}
+
+void square(void* voidptr) {
+    size_t* n = (size_t*)voidptr;
+    *n = *n * *n;
+}
+
+typedef struct {
+    size_t first;
+    _Atomic size_t visited;
+    _Atomic size_t out_of_range;
+} Visits;
+
+void visit(size_t begin, size_t end, void* ctx) {
+    Visits* visits = (Visits*)ctx;
+    if (begin < visits->first || end < begin)
+        atomic_fetch_add(&(visits->out_of_range), 1);
+    atomic_fetch_add(&(visits->visited), end - begin);
+}
+
+void sum_range(size_t begin, size_t end, void* ctx, void* acc) {
+    (void)ctx;
+    for (size_t i = begin; i < end; i++)
+        *(size_t*)acc += i;
+}
+
+void add_sums(void* result, void* acc, void* ctx) {
+    (void)ctx;
+    *(size_t*)result += *(size_t*)acc;
+}
+
 int main() {
     Threadpool pool;
     Threadpool_create(&pool, 8); // 8 tasks to be run at a time
@@ -34,5 +67,60 @@ int main() {
         }
     }
 
+    // To wait for a bunch of tasks, pass a WaitGroup along with them. Each
+    // one counts it down when it's done.
+    _Atomic size_t counted = 0;
+    WaitGroup wg;
+    WaitGroup_init(&wg);
+    for (int i = 0; i < 1000; i++)
+        Threadpool_exectask_group(&pool, count_up, (void*)&counted, &wg);
+    Threadpool_await(&pool, &wg);
+    WaitGroup_destroy(&wg);
+    if (counted != 1000) {
+        printf("The wait group returned with %zu of 1000 tasks done.\n",
+               (size_t)counted);
+        return 1;
+    }
+
+    // To wait for just one, a future does the same thing.
+    size_t n = 12;
+    ThreadpoolFuture future;
+    if (!Threadpool_exectask_future(&pool, square, &n, &future))
+        square(&n);
+    else
+        ThreadpoolFuture_await(&future);
+    if (n != 144) {
+        printf("The future returned before its task was done.\n");
+        return 1;
+    }
+
+    // Loops can be split up over the pool too. Chunks of the range go to
+    // fn(begin, end, ctx) on whichever threads are free, the caller included.
+    Visits visits = {0, 0, 0};
+    Threadpool_parallel_for(&pool, 0, 1000, 0, visit, &visits);
+    if (visits.visited != 1000 || visits.out_of_range) {
+        printf("parallel_for visited %zu of 1000 indices.\n",
+               (size_t)visits.visited);
+        return 1;
+    }
+
+    // Right up against the end of size_t, with chunks of 3.
+    Visits edge = {SIZE_MAX - 10, 0, 0};
+    Threadpool_parallel_for(&pool, SIZE_MAX - 10, SIZE_MAX, 3, visit, &edge);
+    if (edge.visited != 10 || edge.out_of_range) {
+        printf("parallel_for visited %zu of 10 indices near SIZE_MAX.\n",
+               (size_t)edge.visited);
+        return 1;
+    }
+
+    // And reduced. result starts out as the identity, 0 for a sum.
+    size_t sum = 0;
+    Threadpool_parallel_reduce(&pool, 0, 1000, 0, sum_range, add_sums, NULL,
+                               &sum, sizeof(size_t));
+    if (sum != 999 * 1000 / 2) {
+        printf("parallel_reduce summed to %zu.\n", sum);
+        return 1;
+    }
+
     Threadpool_destroy(&pool);
 }
\ No newline at end of file